@@ -0,0 +1,120 @@
+#include "dsh.h"
+#include <sys/file.h>
+
+/* Running C sources as commands: "./tool.c args" compiles tool.c with
+ * $DSH_CC (default cc) and $DSH_CFLAGS (default -O2) and execs the
+ * result. Binaries are kept in <cache dir>/bin under a hash of the source
+ * text, the compiler command, the identity of the compiler binary (so an
+ * upgrade invalidates them) and the flags, so a repeat run goes straight
+ * to exec. Builds of the same key are serialised with a lock file and
+ * land under their final name with rename(), so concurrent runs are safe.
+ *
+ * All of this happens in the child that is about to exec the command, so
+ * compiler diagnostics go to the job's stderr and a failed build fails
+ * the job like any other command. */
+
+static const char *compiler()
+{
+	const char *cc = getenv("DSH_CC");
+	return cc && *cc ? cc : "cc";
+}
+
+static const char *cflags()
+{
+	const char *flags = getenv("DSH_CFLAGS");
+	return flags ? flags : "-O2";
+}
+
+/* hash the device/inode/size/mtime of the compiler found in PATH */
+static uint64_t hash_compiler(uint64_t h, const char *cc)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if(!find_in_path(cc, path, sizeof(path)) || stat(path, &st) < 0)
+		return h;
+	h = hash_bytes(h, &st.st_dev, sizeof(st.st_dev));
+	h = hash_bytes(h, &st.st_ino, sizeof(st.st_ino));
+	h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+	return hash_bytes(h, &st.st_mtim, sizeof(st.st_mtim));
+}
+
+/* run the compiler and wait for it; true on success */
+static bool build(const char *src, const char *out)
+{
+	char *flags = strdup(cflags());
+	char *argv[MAX_ARGS + 5], *save = NULL, *tok;
+	int argc = 0, status;
+	pid_t pid;
+
+	argv[argc++] = (char *)compiler();
+	for(tok = strtok_r(flags, " \t", &save); tok && argc < MAX_ARGS; tok = strtok_r(NULL, " \t", &save))
+		argv[argc++] = tok;
+	argv[argc++] = "-o";
+	argv[argc++] = (char *)out;
+	argv[argc++] = (char *)src;
+	argv[argc] = NULL;
+
+	switch(pid = fork()) {
+	case -1:
+		perror("fork");
+		free(flags);
+		return false;
+	case 0:
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	free(flags);
+	while(waitpid(pid, &status, 0) < 0)
+		if(errno != EINTR)
+			return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Returns the path of an up-to-date binary for the C source src (static
+ * storage), compiling it if needed; NULL if it cannot be built. */
+const char *compile_c(const char *src)
+{
+	static char bin[PATH_MAX + 32];
+	char dir[PATH_MAX], lockname[PATH_MAX + 64], tmp[PATH_MAX + 64];
+	char buf[1 << 16];
+	uint64_t h = FNV_OFFSET;
+	ssize_t n;
+	int fd, lock;
+
+	if((fd = open(src, O_RDONLY)) < 0) {
+		perror(src);
+		return NULL;
+	}
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		h = hash_bytes(h, buf, n);
+	close(fd);
+	h = hash_bytes(h, compiler(), strlen(compiler()) + 1);
+	h = hash_compiler(h, compiler());
+	h = hash_bytes(h, cflags(), strlen(cflags()) + 1);
+
+	snprintf(dir, sizeof(dir), "%s/bin", dsh_cache_dir());
+	mkdir(dir, 0755);
+	snprintf(bin, sizeof(bin), "%s/%016llx", dir, (unsigned long long)h);
+	if(access(bin, X_OK) == 0)
+		return bin;
+
+	/* one build per key at a time; the loser of the race finds it done */
+	snprintf(lockname, sizeof(lockname), "%s.lock", bin);
+	if((lock = open(lockname, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		perror(lockname);
+		return NULL;
+	}
+	while(flock(lock, LOCK_EX) < 0 && errno == EINTR);
+	if(access(bin, X_OK) != 0) {
+		snprintf(tmp, sizeof(tmp), "%s.%d", bin, getpid());
+		if(!build(src, tmp) || rename(tmp, bin) < 0) {
+			unlink(tmp);
+			close(lock);
+			return NULL;
+		}
+	}
+	close(lock); /* drops the lock */
+	return bin;
+}
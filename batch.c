@@ -0,0 +1,475 @@
+#include "dsh.h"
+
+/* Incremental batch execution ("dsh -m script"). The whole script is
+ * parsed up front and the < and > files of every job (plus the file
+ * operands of cat) give a dependency graph: a job waits for the last earlier job that wrote one of its
+ * inputs, and for every earlier job that read or wrote one of its
+ * outputs. Builtins (cd, ...) are barriers that order against everything.
+ * Jobs whose dependencies are done run in parallel, up to the number of
+ * CPUs.
+ *
+ * A job is skipped when it has > outputs, all of them are newer than all
+ * of its < inputs, and the same command text completed successfully the
+ * last time; the hashes of those commands are kept in <script>.dshstate.
+ * Since the check happens when a job becomes ready, a job whose input was
+ * just rebuilt by a dependency is never considered up to date. A job that
+ * runs starts from an empty > file, unless other jobs write it too.
+ *
+ * While the script runs, every finished job is appended to
+ * <script>.dshjournal with its position in the script, command hash and
+ * exit status, and the journal is fsync()ed at most every
+ * JOURNAL_SYNC_MS. A clean finish folds it into the state file and
+ * removes it. If dsh dies halfway, the next run finds the journal and
+ * skips every job it records as successful; jobs that were still running
+ * at the time are not in it and run again. Builtins are never journaled,
+ * since their effect (e.g. cd) does not outlive the shell. */
+
+enum { NODE_WAITING, NODE_RUNNING, NODE_DONE, NODE_FAILED };
+
+typedef struct node {
+	job_t *j;
+	uint64_t hash;      /* of the command text */
+	int state;
+	int waiting;        /* unfinished dependencies */
+	bool journaled;     /* succeeded in an interrupted earlier run */
+	int *dependents;
+	int ndependents, capdependents;
+	bool barrier;
+} node_t;
+
+/* filename -> last writer and readers since that write */
+typedef struct file_ref {
+	struct file_ref *next;
+	char *name;
+	int writer;         /* -1 if no job wrote it yet */
+	int nwriters;       /* jobs in the script that write it */
+	int *readers;
+	int nreaders, capreaders;
+} file_ref_t;
+
+#define FILE_BUCKETS 4096
+
+static node_t *nodes = NULL;
+static int nnodes = 0;
+static file_ref_t *files[FILE_BUCKETS];
+
+static bool push_int(int **arr, int *n, int *cap, int v)
+{
+	if(*n == *cap) {
+		int c = *cap ? *cap * 2 : 4;
+		int *grown = (int *)realloc(*arr, c * sizeof(int));
+		if(!grown)
+			return false;
+		*arr = grown;
+		*cap = c;
+	}
+	(*arr)[(*n)++] = v;
+	return true;
+}
+
+static file_ref_t *file_ref(const char *name)
+{
+	uint64_t h = hash_bytes(FNV_OFFSET, name, strlen(name)) % FILE_BUCKETS;
+	file_ref_t *f;
+
+	for(f = files[h]; f; f = f->next)
+		if(!strcmp(f->name, name))
+			return f;
+	if(!(f = (file_ref_t *)calloc(1, sizeof(file_ref_t))))
+		return NULL;
+	f->name = strdup(name);
+	f->writer = -1;
+	f->next = files[h];
+	files[h] = f;
+	return f;
+}
+
+/* node `to` has to wait for node `from` */
+static void depend(int to, int from)
+{
+	node_t *n;
+	if(from < 0 || from == to)
+		return;
+	n = &nodes[from];
+	/* consecutive duplicates are common (same file read twice) */
+	if(n->ndependents && n->dependents[n->ndependents - 1] == to)
+		return;
+	if(push_int(&n->dependents, &n->ndependents, &n->capdependents, to))
+		++nodes[to].waiting;
+}
+
+/* the i-th file stage p reads, or NULL past the last one: its < file
+ * and, for cat, its file operands */
+static const char *input_file(process_t *p, int i)
+{
+	int a;
+
+	if(p->ifile && i-- == 0)
+		return p->ifile;
+	if(p->argc < 1 || strcmp(p->argv[0], "cat"))
+		return NULL;
+	for(a = 1; a < p->argc; a++)
+		if(p->argv[a][0] != '-' && i-- == 0)
+			return p->argv[a];
+	return NULL;
+}
+
+static void add_node(job_t *j, int *last_barrier, int *since_barrier)
+{
+	node_t *n;
+	process_t *p;
+	int idx = nnodes, i;
+	file_ref_t *f;
+	const char *in;
+
+	n = &nodes[nnodes++];
+	memset(n, 0, sizeof(node_t));
+	n->j = j;
+	n->hash = hash_bytes(FNV_OFFSET, j->commandinfo, strlen(j->commandinfo));
+	n->barrier = is_builtin(j->first_process->argv[0]);
+
+	if(n->barrier) {
+		for(i = *since_barrier; i < idx; i++)
+			depend(idx, i);
+		depend(idx, *last_barrier);
+		*last_barrier = idx;
+		*since_barrier = idx + 1;
+		return;
+	}
+	depend(idx, *last_barrier);
+	for(p = j->first_process; p; p = p->next) {
+		for(i = 0; (in = input_file(p, i)); i++) {
+			if(!(f = file_ref(in)))
+				continue;
+			depend(idx, f->writer);
+			push_int(&f->readers, &f->nreaders, &f->capreaders, idx);
+		}
+		if(p->ofile && (f = file_ref(p->ofile))) {
+			depend(idx, f->writer);
+			for(i = 0; i < f->nreaders; i++)
+				depend(idx, f->readers[i]);
+			f->nreaders = 0;
+			f->writer = idx;
+			++f->nwriters;
+		}
+	}
+}
+
+/* > appends, so a rerun would add to the output of the last run: empty
+ * the job's > file first, as watch does. A file that several jobs write
+ * is left alone, since the others may not run again. */
+static void truncate_output(job_t *j)
+{
+	process_t *p;
+	file_ref_t *f;
+
+	for(p = j->first_process; p->next; p = p->next);
+	if(j->mystdout != OUTPUT_FD || !p->ofile || !(f = file_ref(p->ofile)) || f->nwriters != 1)
+		return;
+	if(truncate(p->ofile, 0) < 0 && errno != ENOENT)
+		perror(p->ofile);
+}
+
+/* state file: one hex command hash per line */
+static uint64_t *known = NULL;
+static int nknown = 0;
+
+static int cmp_hash(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void load_state(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	unsigned long long h;
+	int cap = 0;
+
+	if(!f)
+		return;
+	while(fscanf(f, "%llx", &h) == 1) {
+		if(nknown == cap) {
+			cap = cap ? cap * 2 : 256;
+			uint64_t *grown = (uint64_t *)realloc(known, cap * sizeof(uint64_t));
+			if(!grown)
+				break;
+			known = grown;
+		}
+		known[nknown++] = h;
+	}
+	fclose(f);
+	qsort(known, nknown, sizeof(uint64_t), cmp_hash);
+}
+
+static void save_state(const char *path)
+{
+	char *tmp;
+	FILE *f;
+	int i;
+
+	if(asprintf(&tmp, "%s.tmp", path) < 0)
+		return;
+	if((f = fopen(tmp, "w"))) {
+		for(i = 0; i < nnodes; i++)
+			if(nodes[i].state == NODE_DONE && !nodes[i].barrier)
+				fprintf(f, "%016llx\n", (unsigned long long)nodes[i].hash);
+		if(fclose(f) == 0)
+			rename(tmp, path);
+	}
+	free(tmp);
+}
+
+/* completion journal, see above */
+static int journal_fd = -1;
+static bool journal_dirty = false;
+static double journal_synced = 0;
+
+static void journal_open(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	unsigned long long h;
+	int idx, status, resumed = 0;
+
+	if(f) {
+		while(fscanf(f, "%d %llx %d", &idx, &h, &status) == 3)
+			if(idx >= 0 && idx < nnodes && nodes[idx].hash == h && status == 0
+				&& !nodes[idx].barrier && !nodes[idx].journaled) {
+				nodes[idx].journaled = true;
+				++resumed;
+			}
+		fclose(f);
+		fprintf(stdout, "resuming: %d jobs done in an interrupted run\n", resumed);
+	}
+	if((journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		perror(path);
+	journal_synced = monotonic_now();
+}
+
+static void journal_sync()
+{
+	if(journal_dirty && fdatasync(journal_fd) < 0)
+		perror("journal");
+	journal_dirty = false;
+	journal_synced = monotonic_now();
+}
+
+static void journal_record(int idx, int status)
+{
+	char rec[64];
+	int n;
+
+	if(journal_fd < 0 || nodes[idx].barrier)
+		return;
+	n = snprintf(rec, sizeof(rec), "%d %016llx %d\n", idx, (unsigned long long)nodes[idx].hash, status);
+	if(write(journal_fd, rec, n) != n)
+		perror("journal");
+	journal_dirty = true;
+}
+
+/* how long the wait loop may block before the journal is due for a sync */
+static int journal_timeout()
+{
+	double due;
+
+	if(!journal_dirty)
+		return -1;
+	due = journal_synced + JOURNAL_SYNC_MS / 1000.0 - monotonic_now();
+	return due > 0 ? (int)(due * 1000) + 1 : 0;
+}
+
+static bool newer(struct timespec a, struct timespec b)
+{
+	return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec >= b.tv_nsec);
+}
+
+static bool up_to_date(node_t *n)
+{
+	process_t *p;
+	struct stat st;
+	struct timespec oldest_out = {0, 0}, newest_in = {0, 0};
+	bool have_out = false;
+	const char *in;
+	int i;
+
+	if(!bsearch(&n->hash, known, nknown, sizeof(uint64_t), cmp_hash))
+		return false;
+	for(p = n->j->first_process; p; p = p->next) {
+		for(i = 0; (in = input_file(p, i)); i++) {
+			if(stat(in, &st) < 0)
+				return false;
+			if(newer(st.st_mtim, newest_in))
+				newest_in = st.st_mtim;
+		}
+		if(p->ofile) {
+			if(stat(p->ofile, &st) < 0)
+				return false;
+			if(!have_out || !newer(st.st_mtim, oldest_out))
+				oldest_out = st.st_mtim;
+			have_out = true;
+		}
+	}
+	return have_out && newer(oldest_out, newest_in);
+}
+
+/* Record the outcome of a node and release its dependents. Everything
+ * downstream of a failed job is failed as well and never runs. */
+static void finish_node(int idx, int state, int *ready, int *nready)
+{
+	node_t *n = &nodes[idx];
+	int i;
+
+	n->state = state;
+	for(i = 0; i < n->ndependents; i++) {
+		int didx = n->dependents[i];
+		node_t *d = &nodes[didx];
+		--d->waiting;
+		if(d->state != NODE_WAITING)
+			continue;
+		if(state == NODE_FAILED) {
+			fprintf(stderr, "skipped (dependency failed): %s\n", d->j->commandinfo);
+			finish_node(didx, NODE_FAILED, ready, nready);
+		} else if(d->waiting == 0) {
+			ready[(*nready)++] = didx;
+		}
+	}
+}
+
+/* Runs script in incremental mode; returns 0 if every job succeeded or
+ * was up to date. */
+int run_incremental(FILE *in, const char *script)
+{
+	job_t *j, *ji, *j_next;
+	int cap = 0, i, last_barrier = -1, since_barrier = 0;
+	int *ready, nready = 0, running = 0, failed = 0, skipped = 0, resumed = 0;
+	int *run_idx;
+	char *statefile, *journalfile;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(ncpu < 1)
+		ncpu = 1;
+	while((j = freadcmdline(in, "")) || !feof(in)) {
+		for(ji = j; ji; ji = j_next) {
+			j_next = ji->next;
+			ji->next = NULL;
+			if(nnodes == cap) {
+				cap = cap ? cap * 2 : 256;
+				node_t *grown = (node_t *)realloc(nodes, cap * sizeof(node_t));
+				if(!grown) {
+					fprintf(stderr, "%s\n","malloc: no space");
+					return EXIT_FAILURE;
+				}
+				nodes = grown;
+			}
+			if(ji->first_process->argc == 0) {
+				free_job(ji);
+				continue;
+			}
+			add_node(ji, &last_barrier, &since_barrier);
+		}
+	}
+	fclose(in);
+
+	if(asprintf(&statefile, "%s.dshstate", script) < 0
+		|| asprintf(&journalfile, "%s.dshjournal", script) < 0)
+		return EXIT_FAILURE;
+	load_state(statefile);
+	journal_open(journalfile);
+
+	ready = (int *)malloc((nnodes + 1) * sizeof(int));
+	run_idx = (int *)malloc((nnodes + 1) * sizeof(int));
+	if(!ready || !run_idx) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		return EXIT_FAILURE;
+	}
+	for(i = nnodes - 1; i >= 0; i--) /* so that the first job pops first */
+		if(nodes[i].waiting == 0)
+			ready[nready++] = i;
+
+	/* after Ctrl-C (forwarded to the running jobs) nothing new starts */
+	while((nready > 0 && !dsh_interrupted) || running > 0) {
+		while(nready > 0 && running < ncpu && !dsh_interrupted) {
+			int idx = ready[--nready];
+			node_t *n = &nodes[idx];
+			if(n->barrier) {
+				/* only ready once everything before it finished */
+				append_jobs(n->j);
+				run_job(n->j, false);
+				n->j = NULL;
+				finish_node(idx, NODE_DONE, ready, &nready);
+				continue;
+			}
+			if(n->journaled) {
+				fprintf(stdout, "already done: %s\n", n->j->commandinfo);
+				++resumed;
+				free_job(n->j);
+				n->j = NULL;
+				finish_node(idx, NODE_DONE, ready, &nready);
+				continue;
+			}
+			if(up_to_date(n)) {
+				fprintf(stdout, "up to date: %s\n", n->j->commandinfo);
+				++skipped;
+				journal_record(idx, 0);
+				free_job(n->j);
+				n->j = NULL;
+				finish_node(idx, NODE_DONE, ready, &nready);
+				continue;
+			}
+			truncate_output(n->j);
+			append_jobs(n->j);
+			dsh_last_status = 0;
+			if(deadline_prefix(n->j) || cache_prefix(n->j)) {
+				/* a cache hit, or a bare "deadline <secs>" */
+				journal_record(idx, dsh_last_status);
+				stable_delete_job(n->j);
+				n->j = NULL;
+				finish_node(idx, dsh_last_status ? NODE_FAILED : NODE_DONE, ready, &nready);
+				continue;
+			}
+			/* not before the graph: cat's file may not exist yet */
+			optimize_job(n->j);
+			zstream_job(n->j);
+			spawn_job(n->j, false);
+			n->state = NODE_RUNNING;
+			run_idx[running++] = idx;
+		}
+		if(running == 0)
+			break;
+		event_dispatch(journal_timeout());
+		for(i = 0; i < running; i++) {
+			int idx = run_idx[i];
+			if(!job_is_completed(nodes[idx].j))
+				continue;
+			run_idx[i--] = run_idx[--running];
+			int status = job_status(nodes[idx].j);
+			if(status != 0) {
+				fprintf(stderr, "failed (status %d): %s\n", status, nodes[idx].j->commandinfo);
+				++failed;
+			}
+			journal_record(idx, status);
+			stable_delete_job(nodes[idx].j);
+			nodes[idx].j = NULL;
+			finish_node(idx, status ? NODE_FAILED : NODE_DONE, ready, &nready);
+		}
+		if(journal_timeout() == 0)
+			journal_sync(); /* one fsync for everything that finished meanwhile */
+	}
+
+	save_state(statefile);
+	/* the state file has it all now; the journal only matters after a crash */
+	if(journal_fd >= 0) {
+		close(journal_fd);
+		journal_fd = -1;
+		unlink(journalfile);
+	}
+	for(i = 0; i < nnodes; i++)
+		if(nodes[i].j && nodes[i].j->pgid == -1)
+			free_job(nodes[i].j); /* never spawned, so not on the job list */
+	fprintf(stdout, "%d jobs, %d up to date, %d already done, %d failed\n", nnodes, skipped, resumed, failed);
+	free(statefile);
+	free(journalfile);
+	free(ready);
+	free(run_idx);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
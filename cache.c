@@ -0,0 +1,323 @@
+#include "dsh.h"
+#include <dirent.h>
+
+/* Result cache for deterministic commands. "cache <cmdline>" hashes the
+ * argv of every stage, the identity (device, inode, size, mtime) of every
+ * < input, the text of every here-document, the working directory and the
+ * environment variables listed in DSH_CACHE_ENV. On a hit the stored
+ * output is replayed and the job is never forked. On a miss the job runs
+ * with its final stdout going
+ * through a pipe that dsh tees into the real destination and into a new
+ * cache entry, which is committed once the job exits with status 0.
+ *
+ * Entries live in $DSH_CACHE_DIR (default ~/.cache/dsh), one file per
+ * key: a "dsh-cache <status>" header line followed by the output. The
+ * mtime of an entry is bumped on every hit, and the least recently used
+ * entries are removed once the directory grows past CACHE_MAX_BYTES. */
+
+struct cache {
+	char key[17];       /* hex of the 64-bit hash */
+	int fd;             /* read end of the job's stdout pipe; -1 at EOF */
+	int dest;           /* where the output really goes */
+	FILE *entry;        /* entry being written, under a temporary name */
+	char *tmpname;
+};
+
+/* fixed width, so the status can be filled in after the output */
+#define CACHE_HEADER "dsh-cache %11d\n"
+
+static unsigned long hits = 0, misses = 0;
+
+/* the cache directory, created on first use */
+const char *dsh_cache_dir()
+{
+	static char dir[PATH_MAX];
+	const char *env;
+
+	if(dir[0])
+		return dir;
+	if((env = getenv("DSH_CACHE_DIR")) && *env)
+		snprintf(dir, sizeof(dir), "%s", env);
+	else
+		snprintf(dir, sizeof(dir), "%s/.cache/dsh", getenv("HOME") ? getenv("HOME") : "/tmp");
+	/* create the parents too; failures show up when the entry is opened */
+	char *slash;
+	for(slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(dir, 0755);
+		*slash = '/';
+	}
+	mkdir(dir, 0755);
+	return dir;
+}
+
+static uint64_t hash_str(uint64_t h, const char *s)
+{
+	return hash_bytes(h, s, strlen(s) + 1); /* include the terminator as separator */
+}
+
+static bool job_key(job_t *j, char *key)
+{
+	uint64_t h = FNV_OFFSET;
+	process_t *p;
+	struct stat st;
+	char cwd[PATH_MAX];
+	int i;
+
+	if(getcwd(cwd, sizeof(cwd)))
+		h = hash_str(h, cwd);
+	for(p = j->first_process; p; p = p->next) {
+		h = hash_str(h, "|");
+		for(i = 0; i < p->argc; i++)
+			h = hash_str(h, p->argv[i]);
+		if(p->ifile) {
+			if(stat(p->ifile, &st) < 0)
+				return false; /* let the job report the missing input */
+			h = hash_str(h, "<");
+			h = hash_bytes(h, &st.st_dev, sizeof(st.st_dev));
+			h = hash_bytes(h, &st.st_ino, sizeof(st.st_ino));
+			h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+			h = hash_bytes(h, &st.st_mtim, sizeof(st.st_mtim));
+		}
+		if(p->ofile)
+			h = hash_str(h, p->ofile);
+		if(p->heredoc >= 0) {
+			char buf[1 << 12];
+			ssize_t n;
+			off_t off = 0;
+			h = hash_str(h, "<<");
+			while((n = pread(p->heredoc, buf, sizeof(buf), off)) > 0) {
+				h = hash_bytes(h, buf, n);
+				off += n;
+			}
+		}
+	}
+
+	/* the environment variables the result depends on */
+	const char *names = getenv("DSH_CACHE_ENV");
+	char *list = strdup(names ? names : "PATH:LANG:LC_ALL");
+	char *name, *save = NULL;
+	for(name = strtok_r(list, ":", &save); name; name = strtok_r(NULL, ":", &save)) {
+		const char *val = getenv(name);
+		h = hash_str(h, name);
+		h = hash_str(h, val ? val : "");
+	}
+	free(list);
+
+	snprintf(key, 17, "%016llx", (unsigned long long)h);
+	return true;
+}
+
+/* where the job's final stdout goes: the > file or our own stdout */
+static int open_dest(job_t *j)
+{
+	process_t *p;
+	int fd;
+
+	for(p = j->first_process; p->next; p = p->next);
+	if(j->mystdout != OUTPUT_FD || !p->ofile)
+		return dup(STDOUT_FILENO);
+	if((fd = open(p->ofile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		perror("Couldn't open the output file");
+	return fd;
+}
+
+/* replay a stored entry; returns false if there is no usable entry */
+static bool replay(job_t *j, const char *key)
+{
+	char path[PATH_MAX], buf[1 << 16];
+	FILE *f;
+	int status, dest;
+	size_t n;
+
+	snprintf(path, sizeof(path), "%s/%s", dsh_cache_dir(), key);
+	if(!(f = fopen(path, "r")))
+		return false;
+	if(fscanf(f, "dsh-cache %d", &status) != 1 || fgetc(f) != '\n') {
+		fclose(f);
+		return false;
+	}
+	if((dest = open_dest(j)) < 0) {
+		fclose(f);
+		return true; /* the job would have failed the same way */
+	}
+	fflush(stdout);
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		if(!write_all(dest, buf, n))
+			break;
+	close(dest);
+	fclose(f);
+	utimensat(AT_FDCWD, path, NULL, 0); /* most recently used */
+	dsh_last_status = status;
+	return true;
+}
+
+/* drop least recently used entries until the cache fits CACHE_MAX_BYTES */
+static void evict()
+{
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+	char path[PATH_MAX];
+	off_t total;
+
+	for(;;) {
+		char oldest[PATH_MAX] = "";
+		struct timespec oldest_time = {0, 0};
+		total = 0;
+		if(!(d = opendir(dsh_cache_dir())))
+			return;
+		while((e = readdir(d))) {
+			if(strlen(e->d_name) != 16)
+				continue; /* ".", ".." and entries being written */
+			snprintf(path, sizeof(path), "%s/%s", dsh_cache_dir(), e->d_name);
+			if(stat(path, &st) < 0)
+				continue;
+			total += st.st_size;
+			if(!oldest[0] || st.st_mtim.tv_sec < oldest_time.tv_sec
+				|| (st.st_mtim.tv_sec == oldest_time.tv_sec && st.st_mtim.tv_nsec < oldest_time.tv_nsec)) {
+				snprintf(oldest, sizeof(oldest), "%s", path);
+				oldest_time = st.st_mtim;
+			}
+		}
+		closedir(d);
+		if(total <= CACHE_MAX_BYTES || !oldest[0])
+			return;
+		unlink(oldest);
+	}
+}
+
+/* wait loop callback: pass the job's output on and keep a copy */
+static void cache_readable(int fd, void *arg)
+{
+	cache_t *c = (cache_t *)arg;
+	char buf[1 << 16];
+	ssize_t n;
+
+	while((n = read(fd, buf, sizeof(buf))) > 0) {
+		if(c->dest >= 0 && !write_all(c->dest, buf, n)) {
+			close(c->dest);
+			c->dest = -1;
+		}
+		if(c->entry && fwrite(buf, 1, n, c->entry) != (size_t)n) {
+			fclose(c->entry);
+			c->entry = NULL; /* cache full or gone; just stop recording */
+			unlink(c->tmpname);
+		}
+	}
+	if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		event_del(fd);
+		close(fd);
+		c->fd = -1;
+	}
+}
+
+/* Consume a "cache" prefix. Returns true when the job has been handled
+ * without spawning it: a cache hit, or a bare "cache" (statistics). */
+bool cache_prefix(job_t *j)
+{
+	process_t *p = j->first_process;
+	char key[17];
+
+	if(strcmp(p->argv[0], "cache"))
+		return false;
+	if(p->argc == 1) {
+		fprintf(stdout, "cache: %lu hits, %lu misses (%s)\n", hits, misses, dsh_cache_dir());
+		return true;
+	}
+	shift_argv(p, 1);
+	if(j->bg || !job_key(j, key))
+		return false; /* run it uncached */
+	if(replay(j, key)) {
+		++hits;
+		return true;
+	}
+	++misses;
+	if(!(j->cache = (cache_t *)calloc(1, sizeof(cache_t)))) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		return false;
+	}
+	memcpy(j->cache->key, key, sizeof(key));
+	j->cache->fd = j->cache->dest = -1;
+	return false;
+}
+
+/* Set up the tee for a job that missed the cache; returns the write end
+ * for the last stage's stdout, or -1 if j is not being cached. */
+int cache_start(job_t *j)
+{
+	cache_t *c = j->cache;
+	int fd[2];
+
+	if(!c)
+		return -1;
+	if((c->dest = open_dest(j)) < 0 || pipe2(fd, O_CLOEXEC) < 0) {
+		cache_free(j);
+		return -1;
+	}
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	c->fd = fd[0];
+	if(asprintf(&c->tmpname, "%s/%s.%d", dsh_cache_dir(), c->key, getpid()) < 0)
+		c->tmpname = NULL;
+	if(c->tmpname && !(c->entry = fopen(c->tmpname, "w")))
+		perror(c->tmpname);
+	if(c->entry)
+		fprintf(c->entry, CACHE_HEADER, 0); /* the real status comes later */
+	if(!event_add(fd[0], cache_readable, c)) {
+		close(fd[1]);
+		cache_free(j);
+		return -1;
+	}
+	return fd[1];
+}
+
+/* The job completed: flush the rest of its output and commit the entry.
+ * Only a clean exit with status 0 is kept; a job that failed, was
+ * interrupted or timed out may have left partial output. */
+void cache_finish(job_t *j, int status)
+{
+	cache_t *c = j->cache;
+	char path[PATH_MAX];
+	process_t *p;
+
+	if(!c)
+		return;
+	if(c->fd >= 0)
+		cache_readable(c->fd, c);
+	p = last_stage(j);
+	/* otherwise cache_free() discards the partial entry */
+	if(c->entry && WIFEXITED(p->status) && status == 0 && j->expired == DEADLINE_NONE) {
+		/* fill in the header reserved by cache_start() and publish */
+		FILE *entry = c->entry;
+		c->entry = NULL;
+		snprintf(path, sizeof(path), "%s/%s", dsh_cache_dir(), c->key);
+		rewind(entry);
+		fprintf(entry, CACHE_HEADER, status);
+		if(fclose(entry) == 0 && rename(c->tmpname, path) == 0)
+			evict();
+		else
+			unlink(c->tmpname);
+	}
+	cache_free(j);
+}
+
+void cache_free(job_t *j)
+{
+	cache_t *c = j->cache;
+
+	if(!c)
+		return;
+	if(c->fd >= 0) {
+		event_del(c->fd);
+		close(c->fd);
+	}
+	if(c->dest >= 0)
+		close(c->dest);
+	if(c->entry) {
+		fclose(c->entry);
+		unlink(c->tmpname);
+	}
+	free(c->tmpname);
+	free(c);
+	j->cache = NULL;
+}
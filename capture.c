@@ -0,0 +1,184 @@
+#include "dsh.h"
+
+/* In-memory output capture for background jobs. When capture is on, the
+ * stdout and stderr of a background job go into a pipe that dsh drains
+ * from the wait loop into a per-job queue of fixed-size chunks. A job
+ * keeps at most CAPTURE_JOB_MAX bytes and all jobs together at most
+ * CAPTURE_TOTAL_MAX; beyond that the oldest chunks are evicted first.
+ * Every chunk is also on a global list in arrival order, so finding the
+ * oldest data across all jobs is O(1). */
+
+typedef struct chunk {
+	struct chunk *older, *newer;  /* global arrival order */
+	struct chunk *next;           /* next chunk of the same job */
+	struct capture *owner;
+	size_t len;
+	char data[CAPTURE_CHUNK];
+} chunk_t;
+
+struct capture {
+	int fd;             /* read end of the job's output pipe; -1 at EOF */
+	bool passthrough;   /* copy new output to our stdout (job is in fg) */
+	chunk_t *first, *last;
+	size_t len;         /* bytes held by this job */
+};
+
+bool dsh_capture = false;
+
+static chunk_t *oldest = NULL, *newest = NULL;
+static size_t total_len = 0;
+
+/* drop the oldest chunk of cap */
+static void evict_chunk(capture_t *cap)
+{
+	chunk_t *c = cap->first;
+
+	if(!c)
+		return;
+	cap->first = c->next;
+	if(!cap->first)
+		cap->last = NULL;
+	cap->len -= c->len;
+	total_len -= c->len;
+
+	if(c->older) c->older->newer = c->newer;
+	else oldest = c->newer;
+	if(c->newer) c->newer->older = c->older;
+	else newest = c->older;
+	free(c);
+}
+
+static void append_output(capture_t *cap, const char *buf, size_t n)
+{
+	while(n > 0) {
+		chunk_t *c = cap->last;
+		if(!c || c->len == CAPTURE_CHUNK) {
+			if(!(c = (chunk_t *)malloc(sizeof(chunk_t)))) {
+				fprintf(stderr, "%s\n","malloc: no space");
+				return;
+			}
+			c->len = 0;
+			c->next = NULL;
+			c->owner = cap;
+			if(cap->last) cap->last->next = c;
+			else cap->first = c;
+			cap->last = c;
+			c->newer = NULL;
+			c->older = newest;
+			if(newest) newest->newer = c;
+			else oldest = c;
+			newest = c;
+		}
+		size_t room = CAPTURE_CHUNK - c->len;
+		size_t take = n < room ? n : room;
+		memcpy(c->data + c->len, buf, take);
+		c->len += take;
+		cap->len += take;
+		total_len += take;
+		buf += take;
+		n -= take;
+
+		/* keep the whole chunk being written to */
+		while(cap->len > CAPTURE_JOB_MAX && cap->first != cap->last)
+			evict_chunk(cap);
+		while(total_len > CAPTURE_TOTAL_MAX && oldest && oldest != c)
+			evict_chunk(oldest->owner);
+	}
+}
+
+static void close_capture_fd(capture_t *cap)
+{
+	if(cap->fd < 0)
+		return;
+	event_del(cap->fd);
+	close(cap->fd);
+	cap->fd = -1;
+}
+
+/* wait loop callback: drain whatever the job wrote so far */
+static void capture_readable(int fd, void *arg)
+{
+	capture_t *cap = (capture_t *)arg;
+	char buf[CAPTURE_CHUNK];
+	ssize_t n;
+
+	while((n = read(fd, buf, sizeof(buf))) > 0) {
+		if(cap->passthrough) {
+			fflush(stdout);
+			if(write(STDOUT_FILENO, buf, n) < 0)
+				perror("write");
+		} else {
+			append_output(cap, buf, n);
+		}
+	}
+	if(n == 0 || (errno != EAGAIN && errno != EINTR))
+		close_capture_fd(cap);
+}
+
+/* Set up capture for job j before it is spawned; returns the write end
+ * the children should use for stdout/stderr, or -1 if j is not captured. */
+int capture_start(job_t *j)
+{
+	int fd[2];
+
+	if(!dsh_capture || !j->bg || j->capture)
+		return -1;
+	if(!(j->capture = (capture_t *)calloc(1, sizeof(capture_t)))) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		return -1;
+	}
+	if(pipe2(fd, O_CLOEXEC) < 0) {
+		perror("pipe");
+		free(j->capture);
+		j->capture = NULL;
+		return -1;
+	}
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	j->capture->fd = fd[0];
+	if(!event_add(fd[0], capture_readable, j->capture)) {
+		capture_free(j);
+		close(fd[1]);
+		return -1;
+	}
+	return fd[1];
+}
+
+/* write out everything captured for j so far */
+void capture_print(job_t *j)
+{
+	chunk_t *c;
+
+	if(!j->capture)
+		return;
+	if(j->capture->fd >= 0)
+		capture_readable(j->capture->fd, j->capture);
+	fflush(stdout);
+	for(c = j->capture->first; c; c = c->next)
+		if(write(STDOUT_FILENO, c->data, c->len) < 0) {
+			perror("write");
+			return;
+		}
+}
+
+/* Bring j to the foreground: replay its buffered output, then stream
+ * whatever it writes next straight to our stdout. */
+void capture_replay(job_t *j)
+{
+	if(!j->capture)
+		return;
+	capture_print(j);
+	while(j->capture->first)
+		evict_chunk(j->capture);
+	j->capture->passthrough = true;
+}
+
+void capture_free(job_t *j)
+{
+	if(!j->capture)
+		return;
+	close_capture_fd(j->capture);
+	while(j->capture->first)
+		evict_chunk(j->capture);
+	free(j->capture);
+	j->capture = NULL;
+}
@@ -0,0 +1,97 @@
+#include "dsh.h"
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+/* Per-job deadlines. Each job with a deadline owns a timerfd that is
+ * multiplexed in the dsh wait loop (event.c), so any number of background
+ * jobs can carry a deadline without polling. When the timer fires the
+ * whole process group gets SIGTERM; if it is still around KILL_GRACE_SEC
+ * seconds later it gets SIGKILL. */
+
+int dsh_default_deadline = 0; /* seconds; 0 means no deadline */
+
+static bool arm_timer(int fd, int sec)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = sec;
+	if(timerfd_settime(fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		return false;
+	}
+	return true;
+}
+
+static void deadline_fired(int fd, void *arg)
+{
+	job_t *j = (job_t *)arg;
+	uint64_t expirations;
+
+	if(read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	if(j->expired == DEADLINE_NONE) {
+		j->expired = DEADLINE_TERM;
+		if(kill(-j->pgid, SIGTERM) < 0)
+			perror("kill(SIGTERM)");
+		/* a stopped job would never see the SIGTERM */
+		kill(-j->pgid, SIGCONT);
+		arm_timer(fd, KILL_GRACE_SEC);
+	} else {
+		j->expired = DEADLINE_KILL;
+		if(kill(-j->pgid, SIGKILL) < 0)
+			perror("kill(SIGKILL)");
+		deadline_cancel(j);
+	}
+}
+
+/* Consume a "deadline <secs>" prefix from the first process of j.
+ * "deadline <secs>" on its own sets the shell-wide default instead and
+ * returns true to mark the line as handled. */
+bool deadline_prefix(job_t *j)
+{
+	process_t *p = j->first_process;
+
+	if(p->argc < 2 || strcmp(p->argv[0], "deadline"))
+		return false;
+	int sec = atoi(p->argv[1]);
+	if(sec < 0) {
+		fprintf(stderr, "deadline: invalid number of seconds: %s\n", p->argv[1]);
+		return true;
+	}
+	if(p->argc == 2) {
+		dsh_default_deadline = sec;
+		return true;
+	}
+	j->deadline = sec;
+	shift_argv(p, 2);
+	return false;
+}
+
+/* arm the deadline of a freshly spawned job, if it has one */
+bool deadline_start(job_t *j)
+{
+	if(!j->deadline)
+		j->deadline = dsh_default_deadline;
+	if(!j->deadline || j->deadline_fd >= 0)
+		return true;
+
+	if((j->deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+	if(!arm_timer(j->deadline_fd, j->deadline) || !event_add(j->deadline_fd, deadline_fired, j)) {
+		deadline_cancel(j);
+		return false;
+	}
+	return true;
+}
+
+/* disarm and release the timer; safe to call on any job */
+void deadline_cancel(job_t *j)
+{
+	if(j->deadline_fd < 0)
+		return;
+	event_del(j->deadline_fd);
+	close(j->deadline_fd);
+	j->deadline_fd = -1;
+}
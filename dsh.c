@@ -8,193 +8,260 @@ void spawn_job(job_t *j, bool fg); /* spawn a new job */
 bool free_job(job_t*);
 
 void free_the_program();
+void finish_queue();
 
 void stable_delete_job(job_t* j);
 job_t* first_j = NULL;
 job_t* last_j = NULL;
 
-process_t* find_process(pid_t pid) {
+pid_t dsh_pgid;         /* process group id of dsh */
+int dsh_terminal_fd;    /* terminal file descriptor of dsh */
+int dsh_is_interactive; /* interactive or batch mode */
+int chld_pipe[2] = {-1, -1}; /* SIGCHLD -> wait loop */
+int intr_pipe[2] = {-1, -1}; /* SIGINT, SIGQUIT -> wait loop, without job control */
+int dsh_interrupted = 0;
+bool dsh_quiet = false;      /* no launch messages (dsh -c and scripts) */
+int dsh_last_status = 0;     /* exit status of the last foreground job */
+
+void seize_tty(pid_t callingprocess_pgid)
+{
+	/* Grab control of the terminal.  */
+	/* Don't call this until other initialization is complete */
+  if (dsh_is_interactive) {
+	if(tcsetpgrp(STDIN_FILENO, callingprocess_pgid) < 0) {
+		perror("tcsetpgrp failure (see note in the lab2 FAQ)");
+		exit(EXIT_FAILURE);
+	}
+  }
+}
+
+/* If dsh is running interactively as the foreground job
+ * then set the process group and signal handlers
+ * */
+
+void init_dsh() 
+{
+
+	dsh_terminal_fd = STDIN_FILENO;
+
+	/* isatty(): test whether a file descriptor refers to a terminal 
+	 * isatty() returns 1 if fd is an open file descriptor referring to a
+ 	 * terminal; otherwise 0 is returned, and errno is set to indicate the error.
+ 	 * */
+	dsh_is_interactive = isatty(dsh_terminal_fd);
+
+  	/* See if we are running interactively.  */
+	if(dsh_is_interactive) {
+		/* Loop until we are in the foreground.  */
+		while(tcgetpgrp(dsh_terminal_fd) != (dsh_pgid = getpgrp()))
+			kill(- dsh_pgid, SIGTTIN); /* Request for terminal input */
+
+		/* Ignore interactive and job-control signals.
+		* If tcsetpgrp() is called by a member of a background process 
+		* group in its session, and the calling process is not blocking or
+		* ignoring SIGTTOU,  a SIGTTOU signal is sent to all members of 
+		* this background process group.
+		*/
+		signal(SIGTTOU, SIG_IGN);
+
+		/* Put the dsh in our own process group.  */
+		dsh_pgid = getpid();
+		if(setpgid(dsh_pgid, dsh_pgid) < 0) {
+			perror("Couldn't put the dsh in its own process group");
+			exit(EXIT_FAILURE);
+		}
+		seize_tty(dsh_pgid);
+	} 
+}
+
+/* Find the process with the given pid and the job it belongs to;
+ * NULL if it is not one of ours (e.g. the job was already deleted) */
+process_t* find_process(pid_t pid, job_t** jp) {
   job_t* j;
   process_t* p;
   for (j = first_j; j; j = j->next) {
     for (p = j->first_process; p; p = p->next) {
-      if (p->pid == pid) return p;
+      if (p->pid == pid) {
+        if (jp) *jp = j;
+        return p;
+      }
     }
   }
-  perror("Cannot find process");
-  exit(EXIT_FAILURE);
+  return NULL;
+}
+
+/* Runs of "every" and "watch" entries belong to those modules: they are
+ * not found by pgid, not waited for, and deleted once completed */
+static bool owned_job(job_t* j) {
+  return j->schedule || j->watch;
 }
 
 job_t* find_job(pid_t pgid) {
   job_t* j;
   for (j = first_j; j; j = j->next) {
-    if (j->pgid == pgid) return j;
+    if (j->pgid == pgid && !owned_job(j)) return j;
   }
-  perror("Cannot find job");
-  exit(EXIT_FAILURE);
+  fprintf(stderr, "Cannot find job %d\n", pgid);
+  return NULL;
 }
 
-job_t* find_stopped_job() {
+/* the job named by a builtin argument: a pgid, or q<ticket> for a job
+ * still waiting in the background queue */
+job_t* find_job_arg(const char* arg) {
   job_t* j;
+  if (arg[0] != 'q') return find_job((pid_t)atoi(arg));
   for (j = first_j; j; j = j->next) {
-    if (job_is_stopped(j)) return j;
+    if (j->queued && j->queued == atoi(arg + 1)) return j;
   }
+  fprintf(stderr, "Cannot find job %s\n", arg);
   return NULL;
 }
 
-void wait_job(job_t* j) {
-  pid_t t;
-  process_t* child_p;
-  process_t* p;
-  int status;
-  while ((t = waitpid(-j->pgid, &status, WUNTRACED)) > 0) {
-    //printf("hanged by %d, status = %d\n", t, status);
-    for (p = j->first_process; p; p = p->next) if (p->pid == t) child_p = p;
-    if (WIFSTOPPED(status)) {
-      printf("child stopped\n");
-      printf("[%d]+ Stopped    %s\n", j->pgid, j->commandinfo);
-      child_p -> status = status;
-      child_p -> stopped = true;
-      child_p -> completed = false;
-      break;
-    }
-
-    child_p->status = status;
-    child_p->completed = true;
-    child_p->stopped = false;
+/* the job "fg" and "bg" resume without an argument; job_is_stopped() is
+ * also true for completed jobs */
+job_t* find_stopped_job() {
+  job_t* j;
+  for (j = first_j; j; j = j->next) {
+    if (job_is_stopped(j) && !job_is_completed(j) && !owned_job(j)) return j;
   }
+  return NULL;
 }
 
-/* Sets the process group id for a given job and process */
-int set_child_pgid(job_t *j, process_t *p)
-{
-    if (j->pgid < 0) /* first child: use its pid for job pgid */
-        j->pgid = p->pid;
-    return(setpgid(p->pid,j->pgid));
+/* Called once for every job whose last process has been reaped */
+void job_completed(job_t* j) {
+  deadline_cancel(j);
+  meter_finish(j);
+  cache_finish(j, job_status(j));
+  session_job_done(j);
+  if (j->schedule) schedule_done(j);
+  if (j->watch) watch_done(j);
+  if (!j->bg) dsh_last_status = job_status(j);
+  if (j->expired != DEADLINE_NONE)
+    fprintf(stdout, "%d(Timed out): %s\n", j->pgid, j->commandinfo);
 }
 
-/* Creates the context for a new child by setting the pid, pgid and tcsetpgrp */
-void new_child(job_t *j, process_t *p, bool fg)
-{
-         /* establish a new process group, and put the child in
-          * foreground if requested
-          */
-
-         /* Put the process into the process group and give the process
-          * group the terminal, if appropriate.  This has to be done both by
-          * the dsh and in the individual child processes because of
-          * potential race conditions.
-          * */
-
-         p->pid = getpid();
-
-         /* also establish child process group in child to avoid race (if parent has not done it yet). */
-         set_child_pgid(j, p);
+/* Reaps every child that changed state. Runs from the wait loop whenever
+ * signal_chld() pokes the reaper pipe, so waitpid() is only ever called
+ * here and foreground and background jobs are treated alike. */
+void reap_children(int fd, void* arg) {
+  char buf[64];
+  int status;
+  pid_t pid;
+  job_t* j;
+  process_t* p;
 
-         if(fg) // if fg is set
-		seize_tty(j->pgid); // assign the terminal
+  struct rusage ru;
 
-         /* Set the handling for job control signals back to the default. */
-         signal(SIGTTOU, SIG_DFL);
+  while (read(fd, buf, sizeof(buf)) > 0);
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+    if (!(p = find_process(pid, &j))) continue;
+    if (WIFCONTINUED(status)) {
+      p->stopped = false;
+      continue;
+    }
+    p->status = status;
+    if (WIFSTOPPED(status)) {
+      p->stopped = true;
+    } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      p->completed = true;
+      p->stopped = false;
+      timeradd(&j->rusage.ru_utime, &ru.ru_utime, &j->rusage.ru_utime);
+      timeradd(&j->rusage.ru_stime, &ru.ru_stime, &j->rusage.ru_stime);
+      if (ru.ru_maxrss > j->rusage.ru_maxrss) j->rusage.ru_maxrss = ru.ru_maxrss;
+      if (job_is_completed(j)) job_completed(j);
+    }
+  }
+  queue_admit(first_j);
+  jobtable_publish(first_j);
 }
 
-/* Spawning a process with job control. fg is true if the
- * newly-created process is to be placed in the foreground.
- * (This implicitly puts the calling process in the background,
- * so watch out for tty I/O after doing this.) pgid is -1 to
- * create a new job, in which case the returned pid is also the
- * pgid of the new job.  Else pgid specifies an existing job's
- * pgid: this feature is used to start the second or
- * subsequent processes in a pipeline.
- * */
+/* Blocks in the wait loop until every process of j stopped or completed */
+void wait_job(job_t* j) {
+  while (!job_is_stopped(j)) event_dispatch(-1);
+  if (!job_is_completed(j)) {
+    printf("child stopped\n");
+    printf("[%d]+ Stopped    %s\n", j->pgid, j->commandinfo);
+  }
+}
 
-void spawn_job(job_t *j, bool fg)
+/* Replaces the calling process with p. A C source file as argv[0] is
+ * compiled first (see autocc.c), and a ZSTREAM_CMD stage runs in dsh
+ * itself (see zstream.c); returns only if that or the exec fails */
+void exec_process(process_t *p)
 {
-
-	pid_t pid;
-	process_t *p;
-
-  int input = STDIN_FILENO;
-	for(p = j->first_process; p; p = p->next) {
-
-	  /* YOUR CODE HERE? */
-	  /* Builtin commands are already taken care earlier */
-    int fd[2];
-    pipe(fd);
-	  switch (pid = fork()) {
-
-      case -1: /* fork failure */
-        perror("fork");
-        exit(EXIT_FAILURE);
-
-      case 0: /* child process  */
-        p->pid = getpid();
-        new_child(j, p, fg);
-
-        if(input != STDIN_FILENO){
-          dup2(input, STDIN_FILENO);
-          close(input);
+        if(!strcmp(p->argv[0], ZSTREAM_CMD)){
+          fflush(stdout);
+          _exit(zstream_main(p->argc, p->argv));
         }
-
-        if(p->next != NULL){
-          close(fd[0]);
-          dup2(fd[1], STDOUT_FILENO);
-          close(fd[1]);
-        }
-
-    /* YOUR CODE HERE?  Child-side code for new process. */
-
-        if(j->mystdin == INPUT_FD && p->ifile != NULL){
-          int in;
-          if ((in = open(p->ifile, O_RDONLY, 0)) < 0) {
-            perror("Couldn't open input file");
-            exit(EXIT_FAILURE);
-          }
-          dup2(in, STDIN_FILENO);
-          close(in);
+        if(endswith(p->argv[0], ".c")){
+          const char *bin = compile_c(p->argv[0]);
+          if(!bin) _exit(EXIT_FAILURE); /* the compiler said why */
+          execv(bin, p->argv);
+          return;
         }
+        execvp(*p->argv, p->argv);
+}
 
+/* what the child side of spawn_job() needs */
+typedef struct spawn {
+  bool fg;
+  int cache_fd;
+} spawn_t;
 
-        if(j->mystdout == OUTPUT_FD && p->ofile != NULL && p->next == NULL){
-          int out;
-          if ((out = open(p->ofile, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0){
-            perror("Couldn't open the output file");
-            exit(EXIT_FAILURE);
-          }
-          dup2(out, STDOUT_FILENO);
-          close(out);
-        }
-        execvp(*p->argv, p->argv);
+/* in the child, as soon as it is in the job's process group */
+static void spawn_child(job_t *j, process_t *p, void *arg) {
+  if (((spawn_t*)arg)->fg) seize_tty(j->pgid); /* also done by dsh, whichever runs first */
+}
 
-        perror("New child should have done an exec");
-        exit(EXIT_FAILURE);  /* NOT REACHED */
-        break;    /* NOT REACHED */
+/* in the child, once its fds are set up */
+static void spawn_exec(job_t *j, process_t *p, void *arg) {
+  spawn_t* s = (spawn_t*)arg;
+  if (s->cache_fd >= 0 && p->next == NULL) {
+    dup2(s->cache_fd, STDOUT_FILENO); /* dsh writes the > file itself */
+  }
+  exec_process(p);
+  perror("New child should have done an exec");
+  _exit(EXIT_FAILURE);
+}
 
-      default: /* parent */
-        /* establish child process group */
-        p->pid = pid;
-        set_child_pgid(j, p);
-        if(p != j->first_process){
-          close(input);
-        }
-        close(fd[1]);
-        if(p->next != NULL){
-          input = fd[0];
-        }else{
-          close(fd[0]);
-        }
-        /* YOUR CODE HERE?  Parent-side code for new process.  */
-        if (p == j->first_process) {
-          fprintf(stdout, "%d(Lanuched): %s\n", j->pgid, j->commandinfo);
-        }
+/* Spawning a job with job control. fg is true if the newly-created
+ * job is to be placed in the foreground. (This implicitly puts the
+ * calling process in the background, so watch out for tty I/O after
+ * doing this.) The forking itself is job_fork() (libdsh.c); dsh adds
+ * the terminal, output capture, metering and the result cache. */
+void spawn_job(job_t *j, bool fg)
+{
+  process_t *p;
+  int capture_fd = capture_start(j);
+  spawn_t s = { fg, cache_start(j) };
+  job_ops_t ops = { meter_edge, spawn_child, spawn_exec, &s };
+
+  if (!job_fork(j, -1, capture_fd, capture_fd, &ops)) {
+    /* a pipe or fork failed (job_fork() said why): the job fails, and
+     * the stages that did start are killed and reaped as usual */
+    for (p = j->first_process; p; p = p->next) {
+      if (p->pid > 0) continue;
+      p->completed = true;
+      p->status = EXIT_FAILURE << 8; /* as if it exited with 1 */
     }
+    if (j->pgid > 0) {
+      kill(-j->pgid, SIGKILL);
+    } else {
+      job_completed(j);
+    }
+  } else if (!dsh_quiet) {
+    fprintf(stdout, "%d(Lanuched): %s\n", j->pgid, j->commandinfo);
   }
+  j->start = time(NULL);
+  j->spawned = monotonic_now();
+  jobtable_publish(first_j);
+  if (capture_fd >= 0) close(capture_fd);
+  if (s.cache_fd >= 0) close(s.cache_fd);
+  deadline_start(j);
   if (fg) {
     wait_job(j);
-  }
-
-            /* YOUR CODE HERE?  Parent-side code for new job.*/
-  seize_tty(getpid()); // assign the terminal back to dsh
+    seize_tty(getpid()); // assign the terminal back to dsh
+  } /* a background job may be admitted from the queue while another job owns the terminal */
 }
 
 /* Sends SIGCONT signal to wake up the blocked job */
@@ -204,117 +271,319 @@ void continue_job(job_t *j)
           perror("kill(SIGCONT)");
 }
 
+void brief_print_job_one(job_t* j) {
+  char* running_status[3] = {"completed", "stopped", "running"};
+  bool completed = job_is_completed(j);
+  bool stopped = job_is_stopped(j);
+  if (j->queued)
+    fprintf(stdout, "q%d(queued, prio %d) ", j->queued, j->prio);
+  else if (completed && j->expired != DEADLINE_NONE)
+    fprintf(stdout, "%d(timed out) ", j->pgid);
+  else
+    fprintf(stdout, "%d(%s) ", j->pgid, running_status[!stopped + !completed]);
+  fprintf(stdout, "%s\n", j->commandinfo);
+}
+
 void brief_print_job(job_t* first_job) {
   job_t* j = first_job;
-  char* running_status[3] = {"completed", "stopped", "running"};
   while (j) {
-    bool completed = job_is_completed(j);
-    bool stopped = job_is_stopped(j);
-    fprintf(stdout, "%d(%s) ", j->pgid, running_status[!stopped + !completed]);
-    fprintf(stdout, "%s\n", j->commandinfo);
+    brief_print_job_one(j);
     j = j->next;
   }
 }
 
+void delete_owned_jobs() {
+  job_t* j;
+  job_t* j_next;
+  for (j = first_j; j; j = j_next) {
+    j_next = j->next;
+    if (owned_job(j) && job_is_completed(j)) stable_delete_job(j);
+  }
+}
+
+/* Drops completed jobs, except background jobs whose status nobody has
+ * collected with wait yet; of those only the newest MAX_HISTORY are kept,
+ * so a session that never waits does not grow without bound */
 void delete_completed_job() {
   job_t* j;
   job_t* j_next;
+  int unwaited = 0;
+  for (j = first_j; j; j = j->next) {
+    if (job_is_completed(j) && j->bg && !j->waited && !owned_job(j)) ++unwaited;
+  }
   for(j = first_j; j;) {
     j_next = j->next;
     if(job_is_completed(j)) {
-      stable_delete_job(j);
+      if (!j->bg || j->waited || owned_job(j)) {
+        stable_delete_job(j);
+      } else if (unwaited > MAX_HISTORY) { /* the oldest go first */
+        --unwaited;
+        stable_delete_job(j);
+      }
     }
     j = j_next;
   }
 }
 
-void list_jobs() {
-  brief_print_job(first_j);
+/* true while a job is running or waiting in the queue; stopped jobs
+ * do not count since nothing would resume them, nor do the runs of
+ * "every" and "watch" entries, which never end */
+bool jobs_running() {
+  job_t* j;
+  for (j = first_j; j; j = j->next) {
+    if (owned_job(j)) continue;
+    if (j->queued || (j->pgid != -1 && !job_is_stopped(j))) return true;
+  }
+  return false;
+}
+
+/* "wait -n": blocks until any background job is done and returns its
+ * status; a job that finished before the call and was not waited for
+ * yet counts too. 127 if there is nothing to wait for. */
+int wait_any() {
+  job_t* j;
+  bool pending;
+  for (;;) {
+    pending = false;
+    for (j = first_j; j; j = j->next) {
+      if (!j->bg || owned_job(j)) continue;
+      if (!j->waited && j->pgid != -1 && job_is_completed(j)) {
+        j->waited = true;
+        return job_status(j);
+      }
+      if (j->queued || (j->pgid != -1 && !job_is_stopped(j))) pending = true;
+    }
+    if (!pending) return 127;
+    event_dispatch(-1); /* the reaper runs from here */
+  }
+}
+
+/* "wait [pgid|q<ticket>...]": blocks until the given jobs, or all
+ * background jobs, are done or stopped; returns the status of the last
+ * one named (0 without arguments, 127 if a job does not exist) */
+int wait_jobs(int argc, char** argv) {
+  job_t* j;
+  int i, status = 0;
+  if (argc == 1) {
+    while (jobs_running()) event_dispatch(-1);
+    for (j = first_j; j; j = j->next) {
+      if (j->bg && job_is_completed(j)) j->waited = true;
+    }
+    return 0;
+  }
+  for (i = 1; i < argc; i++) {
+    if (!(j = find_job_arg(argv[i]))) {
+      status = 127;
+      continue;
+    }
+    while (j->queued || !job_is_stopped(j)) event_dispatch(-1);
+    j->waited = job_is_completed(j);
+    status = job_status(j);
+  }
+  return status;
+}
+
+int count_jobs() {
+  int n = 0;
+  job_t* j;
+  for (j = first_j; j; j = j->next) ++n;
+  return n;
+}
+
+void list_jobs(bool long_format) {
+  job_t* j;
+  if (long_format) {
+    for (j = first_j; j; j = j->next) {
+      brief_print_job_one(j);
+      meter_print(j);
+    }
+  } else {
+    brief_print_job(first_j);
+  }
   delete_completed_job();
 }
 
 
+/* takes j off the job list without freeing it */
+static void unlink_job(job_t* j) {
+  job_t** link;
+  for (link = &first_j; *link; link = &(*link)->next) {
+    if (*link == j) {
+      *link = j->next;
+      j->next = NULL;
+      return;
+    }
+  }
+}
+
+static void builtin_quit(job_t* j, int argc, char** argv) {
+  free_job(j);
+  free_the_program();
+  exit(EXIT_SUCCESS);
+}
+
+static void builtin_jobs(job_t* j, int argc, char** argv) {
+  list_jobs(argc == 2 && !strcmp(argv[1], "-l"));
+}
+
+static void builtin_cd(job_t* j, int argc, char** argv) {
+  if (chdir(argc > 1 ? argv[1] : getenv("HOME") ? getenv("HOME") : "/")) {
+    perror("Error deteced when changing directory");
+  }
+}
+
+static void builtin_bg(job_t* j, int argc, char** argv) {
+  job_t* j_bg = NULL;
+  process_t* p;
+  if (argc == 2) {
+    j_bg = find_job_arg(argv[1]);
+  } else if (argc == 1) {
+    j_bg = find_stopped_job();
+    if (!j_bg) fprintf(stderr, "bg: no stopped job\n");
+  } else {
+    fprintf(stderr, "too many arguments for bg\n");
+  }
+  if (!j_bg) return;
+  if (j_bg->queued) { /* start it now, regardless of the limit */
+    queue_start(j_bg, false);
+    return;
+  }
+  if (kill(-j_bg->pgid, SIGCONT) < 0)
+    perror("kill (SIGCONT)");
+  for (p = j_bg->first_process; p; p = p->next) {
+    p->stopped = false;
+  }
+}
+
+static void builtin_fg(job_t* j, int argc, char** argv) {
+  job_t* j_fg = NULL;
+  process_t* p;
+  if (argc == 2) {
+    j_fg = find_job_arg(argv[1]);
+  } else if (argc == 1) {
+    j_fg = find_stopped_job();
+  } else {
+    fprintf(stderr, "too many arguments for fg\n");
+  }
+  if (!j_fg) return;
+  if (j_fg->queued) { /* run it right away, in the foreground */
+    queue_start(j_fg, true);
+    capture_print(j_fg);
+    return;
+  }
+  capture_replay(j_fg);
+  seize_tty(j_fg->pgid);
+  if (kill(-j_fg->pgid, SIGCONT) < 0)
+    perror("kill (SIGCONT)");
+  for (p = j_fg->first_process; p; p = p->next) {
+    p->stopped = false;
+  }
+  wait_job(j_fg);
+  capture_print(j_fg);
+  seize_tty(getpid());
+}
+
+static void builtin_output(job_t* j, int argc, char** argv) {
+  job_t* j_out = NULL;
+  if (argc == 2) j_out = find_job((pid_t)atoi(argv[1]));
+  else fprintf(stderr, "usage: output <pgid>\n");
+  if (j_out) capture_print(j_out);
+}
+
+static void builtin_meter(job_t* j, int argc, char** argv) {
+  if (argc == 2 && !strcmp(argv[1], "on")) dsh_meter = true;
+  else if (argc == 2 && !strcmp(argv[1], "off")) dsh_meter = false;
+  else fprintf(stdout, "meter is %s\n", dsh_meter ? "on" : "off");
+}
+
+static void builtin_capture(job_t* j, int argc, char** argv) {
+  if (argc == 2 && !strcmp(argv[1], "on")) dsh_capture = true;
+  else if (argc == 2 && !strcmp(argv[1], "off")) dsh_capture = false;
+  else fprintf(stdout, "capture is %s\n", dsh_capture ? "on" : "off");
+}
+
+static void builtin_optimize(job_t* j, int argc, char** argv) {
+  if (argc == 2 && !strcmp(argv[1], "on")) dsh_optimize = OPTIMIZE_ON;
+  else if (argc == 2 && !strcmp(argv[1], "off")) dsh_optimize = OPTIMIZE_OFF;
+  else if (argc == 2 && !strcmp(argv[1], "verbose")) dsh_optimize = OPTIMIZE_VERBOSE;
+  else fprintf(stdout, "optimize is %s\n", dsh_optimize == OPTIMIZE_OFF ? "off"
+               : dsh_optimize == OPTIMIZE_VERBOSE ? "verbose" : "on");
+}
+
+static void builtin_wait(job_t* j, int argc, char** argv) {
+  if (argc == 2 && !strcmp(argv[1], "-n")) dsh_last_status = wait_any();
+  else dsh_last_status = wait_jobs(argc, argv);
+}
+
+static void builtin_compress(job_t* j, int argc, char** argv) {
+  compress_cmd(argc, argv);
+}
+
+static void builtin_queue(job_t* j, int argc, char** argv) {
+  queue_cmd(first_j, argc, argv);
+}
+
+static void builtin_prio(job_t* j, int argc, char** argv) {
+  job_t* j_prio = NULL;
+  if (argc == 3) j_prio = find_job_arg(argv[1]);
+  else fprintf(stderr, "usage: prio <q<ticket>|pgid> <priority>\n");
+  if (j_prio && !j_prio->queued) {
+    fprintf(stderr, "prio: %d is already running\n", j_prio->pgid);
+  } else if (j_prio) {
+    j_prio->prio = atoi(argv[2]);
+  }
+}
+
+static void builtin_prefetch(job_t* j, int argc, char** argv) {
+  prefetch_cmd(argc, argv);
+}
+
+static void builtin_source(job_t* j, int argc, char** argv) {
+  if (argc != 2) fprintf(stderr, "usage: source <file>\n");
+  else source_file(argv[1], true);
+}
+
+/* Enters the builtins into the name table (names.c), where builtin_cmd()
+ * finds them along with aliases and functions */
+void init_builtins() {
+  static const struct {
+    const char* name;
+    builtin_fn fn;
+  } builtins[] = {
+    { "quit", builtin_quit }, { "jobs", builtin_jobs }, { "cd", builtin_cd },
+    { "bg", builtin_bg }, { "fg", builtin_fg }, { "output", builtin_output },
+    { "meter", builtin_meter }, { "capture", builtin_capture },
+    { "optimize", builtin_optimize }, { "wait", builtin_wait },
+    { "compress", builtin_compress }, { "queue", builtin_queue },
+    { "prio", builtin_prio }, { "source", builtin_source },
+    { "prefetch", builtin_prefetch }, { "every", every_cmd },
+    { "watch", watch_cmd },
+    { "alias", alias_cmd }, { "unalias", alias_cmd },
+    { "function", function_cmd }, { "unfunction", function_cmd },
+    { NULL, NULL }
+  };
+  int i;
+  for (i = 0; builtins[i].name; i++)
+    builtin_register(builtins[i].name, builtins[i].fn);
+}
+
 /*
- * builtin_cmd - If the user has typed a built-in command then execute
- * it immediately.
+ * builtin_cmd - If the user has typed a built-in command or called a
+ * function then execute it immediately.
  */
 bool builtin_cmd(job_t *last_job, int argc, char **argv)
 {
-
-	    /* check whether the cmd is a built in command
-        */
-
         job_t* j = last_job;
-        if (!strcmp(argv[0], "quit")) {
-            /* Your code here */
-            free_the_program();
-            exit(EXIT_SUCCESS);
-	      }
-        else if (!strcmp("jobs", argv[0])) {
-            /* Your code here */
-            stable_delete_job(j);
-            list_jobs();
-            return true;
-        }
-        else if (!strcmp("cd", argv[0])) {
-            /* Your code here */
-
-            j->pgid = getpid();
-            int res;
-            res = chdir(argv[1]);
-            if(res){
-              perror("Error deteced when changing directory");
-            }
-            stable_delete_job(j);
-            return true;
-        }
-        else if (!strcmp("bg", argv[0])) {
-            /* Your code here */
-            pid_t pgid = -1;
-            if (argc == 2) {
-              pgid = (pid_t)atoi(argv[1]);
-            } else if (argc == 1) {
-              job_t* j_stopped = find_stopped_job();
-              if (j_stopped) pgid = j_stopped->pgid;
-            } else {
-              perror("too many arguments for bg");
-              exit(EXIT_FAILURE);
-            }
-            if (kill( -pgid, SIGCONT) < 0)
-              perror("kill (SIGCONT)");
-            process_t* p;
-            for (p = find_job(pgid)->first_process; p; p = p->next) {
-              p->stopped = false;
-            }
-            stable_delete_job(j);
-            return true;
-        }
-        else if (!strcmp("fg", argv[0])) {
-            /* Your code here */
-            pid_t pgid = -1;
-            if (argc == 2) {
-              pgid = (pid_t)atoi(argv[1]);
-            } else if (argc == 1) {
-              job_t* j_stopped = find_stopped_job();
-              if (j_stopped) pgid = j_stopped->pgid;
-            } else {
-              perror("too many arguments for fg");
-              exit(EXIT_FAILURE);
-            }
-            if (pgid == -1) return true;
-            seize_tty(pgid);
-            if (kill( -pgid, SIGCONT) < 0)
-              perror("kill (SIGCONT)");
-            process_t* p;
-            for (p = find_job(pgid)->first_process; p; p = p->next) {
-              p->stopped = false;
-            }
-            wait_job(find_job(pgid));
-            seize_tty(getpid());
-            stable_delete_job(j);
-            return true;
-        }
-        return false;       /* not a builtin command */
+        builtin_fn fn = builtin_lookup(argv[0]);
+        if (!fn && !is_builtin(argv[0]))
+            return false;   /* not a builtin command */
+
+        /* off the list while it runs, so e.g. jobs does not show it */
+        unlink_job(j);
+        if (fn) fn(j, argc, argv);
+        else function_call(argc, argv);
+        free_job(j);
+        return true;
 }
 
 void stable_delete_job(job_t* j) {
@@ -325,6 +594,19 @@ void stable_delete_job(job_t* j) {
   } else {
     delete_job(j, first_j);
   }
+  jobtable_publish(first_j);
+}
+
+/* Prints msg and parses the next command line from in; what is read
+ * from stdin goes into the session log (session.c) */
+job_t* freadcmdline(FILE *in, char *msg) {
+  fprintf(stdout, "%s", msg);
+  if (in == stdin) return parse_stream(in, session_line, session_body);
+  return parse_stream(in, NULL, NULL);
+}
+
+job_t* readcmdline(char *msg) {
+  return freadcmdline(stdin, msg);
 }
 
 /* Build prompt messaage */
@@ -336,13 +618,52 @@ char* promptmsg()
 	return buffer;
 }
 
-void run_job(job_t* j)
+/* True if j can replace dsh itself instead of being forked: a single
+ * foreground command that needs nothing from dsh once it runs, while no
+ * background job is queued (it would never start) or running */
+bool can_exec_in_place(job_t* j) {
+  return !j->bg && j->first_process->next == NULL && !j->deadline
+    && !dsh_default_deadline && !j->cache && !schedule_pending()
+    && !watch_pending() && !jobs_running();
+}
+
+/* exec j in the dsh process itself; does not return */
+void exec_in_place(job_t* j) {
+  process_t* p = j->first_process;
+  fflush(stdout);
+  signal(SIGPIPE, SIG_DFL);
+  redirect_io(j, p);
+  exec_process(p);
+  perror("New child should have done an exec");
+  exit(127);
+}
+
+/* Runs one parsed job; last is true when nothing can follow it, so it
+ * may take over the dsh process if it needs no job control */
+void run_job(job_t* j, bool last)
 {
     // Suppose only one process
     process_t* p = j->first_process;
+    session_run(j);
+    for (; p; p = p->next) {
+      if (p->argc == 0) { /* e.g. a dangling | */
+        fprintf(stderr, "reading cmdline: empty command\n");
+        stable_delete_job(j);
+        return;
+      }
+    }
+    if (!alias_expand(j) || deadline_prefix(j) || cache_prefix(j)) {
+        stable_delete_job(j);
+        return;
+    }
+    p = j->first_process;
     if (! builtin_cmd(j, p->argc, p->argv)) {
+        optimize_job(j);
+        zstream_job(j);
+        prefetch_job(j);
+        if (last && can_exec_in_place(j)) exec_in_place(j);
         if (j->bg) {
-            spawn_job(j, false);
+            if (!queue_job(j, first_j)) spawn_job(j, false);
         } else {
             spawn_job(j, true);
         }
@@ -358,30 +679,115 @@ void append_jobs(job_t* j) {
   }
 }
 
+/* Appends the jobs parsed from one command line and runs them, and only
+ * them: jobs appended while they run (a function body, an "every" or
+ * "watch" run) are run by whoever appended them. last is run_job()'s
+ * flag for the final job. */
+void run_jobs(job_t* j, bool last) {
+  job_t* j_next;
+  int n = 0;
+  for (j_next = j; j_next; j_next = j_next->next) n++;
+  append_jobs(j);
+  for (; n > 0; n--, j = j_next) {
+    j_next = j->next; /* run_job() may delete j */
+    if (dsh_interrupted) stable_delete_job(j); /* never ran, never will */
+    else run_job(j, last && n == 1);
+  }
+}
+
+/* Only wakes up the wait loop; reap_children() does the waitpid() */
 void signal_chld(int signum) {
-  int status;
-  int pid;
-  process_t* p;
-  pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED);
-    
-  if (pid > 0) {
-    p = find_process(pid);
-    if (WIFSTOPPED(status)) p->stopped = true;
-    if (WIFEXITED(status)) p->completed = true;
-    if (WIFCONTINUED(status)) p->stopped = false;
+  int saved_errno = errno;
+  if (write(chld_pipe[1], "", 1) < 0) { /* pipe full: a wakeup is already pending */ }
+  errno = saved_errno;
+}
+
+static void signal_intr(int signum) {
+  int saved_errno = errno;
+  char sig = (char)signum;
+  if (write(intr_pipe[1], &sig, 1) < 0) { /* pipe full: already interrupted */ }
+  errno = saved_errno;
+}
+
+/* Passes the interrupt on to every running job and stops taking commands */
+static void forward_intr(int fd, void* arg) {
+  char buf[16];
+  ssize_t n;
+  job_t* j;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) dsh_interrupted = buf[n - 1];
+  if (!dsh_interrupted) return;
+  for (j = first_j; j; j = j->next) {
+    if (j->pgid > 0 && !job_is_completed(j)) kill(-j->pgid, dsh_interrupted);
+  }
+}
+
+/* Without job control (dsh -c, scripts, -m) every job still has a process
+ * group of its own, which Ctrl-C on the terminal does not reach: dsh
+ * catches SIGINT and SIGQUIT and forwards them instead. */
+void forward_interrupts() {
+  if (pipe2(intr_pipe, O_CLOEXEC | O_NONBLOCK) < 0 || !event_add(intr_pipe[0], forward_intr, NULL)) {
+    perror("Couldn't forward interrupts");
+    return;
+  }
+  signal(SIGINT, &signal_intr);
+  signal(SIGQUIT, &signal_intr);
+}
+
+/* Once the interrupted jobs are gone, dies of the same signal, so the
+ * caller sees how dsh ended */
+static void exit_if_interrupted() {
+  if (!dsh_interrupted) return;
+  signal(dsh_interrupted, SIG_DFL);
+  raise(dsh_interrupted);
+}
+
+static void input_ready(int fd, void* arg) {
+  *(bool*)arg = true;
+}
+
+/* Runs the wait loop until there is input on the terminal, so deadlines
+ * and other events of background jobs are served while at the prompt */
+void wait_input() {
+  bool ready = false;
+  if (!dsh_is_interactive) {
+    event_dispatch(0);
+    return;
+  }
+  fflush(stdout);
+  prefetch_warm(); /* the prompt is out; the user types meanwhile */
+  event_add(STDIN_FILENO, input_ready, &ready);
+  while (!ready) {
+    event_dispatch(-1);
+    delete_owned_jobs();
   }
+  event_del(STDIN_FILENO);
 }
 
+/* At the end of input: without job control, queued jobs still get to
+ * start before dsh exits; any left over (Ctrl-D at the prompt, Ctrl-C)
+ * are reported as dropped rather than vanishing silently */
+void finish_queue() {
+  job_t* j;
+  while (!dsh_is_interactive && !dsh_interrupted && queue_pending(first_j)) {
+    event_dispatch(-1);
+  }
+  for (j = first_j; j; j = j->next) {
+    if (j->queued) fprintf(stderr, "q%d(Discarded): %s\n", j->queued, j->commandinfo);
+  }
+}
+
+/* Frees every job before exit. An interactive dsh kills the jobs still
+ * running; without job control they outlive dsh, as with sh. */
 void free_the_program() {
   job_t* j;
   process_t* p;
   job_t* j_next;
   for( j = first_j; j != NULL; ) {
     j_next = j->next;
-    if (job_is_completed(j)) free_job(j);
+    if (job_is_completed(j) || !dsh_is_interactive) free_job(j);
     else {
       for (p = j->first_process; p != NULL && p->pid != -1; p = p->next) {
-      	printf("pid: %d\n", p->pid); kill(p->pid, SIGKILL);
+        kill(p->pid, SIGKILL);
       }
       free_job(j);
     }
@@ -389,21 +795,132 @@ void free_the_program() {
   }
 }
 
+/* Runs the commands in path in this shell, as the source builtin and for
+ * the rc file; false if path cannot be opened */
+bool source_file(const char* path, bool must_exist) {
+  FILE* in = fopen(path, "re");
+  job_t* j;
+  if (!in) {
+    if (must_exist) perror(path);
+    return false;
+  }
+  while ((j = freadcmdline(in, "")) || !feof(in)) {
+    if (!j) continue;
+    run_jobs(j, false);
+    if (count_jobs() > MAX_HISTORY) delete_completed_job();
+  }
+  fclose(in);
+  return true;
+}
+
+/* $DSH_RC, or ~/.dshrc; an empty DSH_RC skips it */
+void load_rc() {
+  char path[PATH_MAX];
+  const char* rc = getenv("DSH_RC");
+  if (rc) {
+    if (*rc) source_file(rc, true);
+    return;
+  }
+  if (!getenv("HOME")) return;
+  snprintf(path, sizeof(path), "%s/.dshrc", getenv("HOME"));
+  source_file(path, false);
+}
+
+/* Runs a command string (dsh -c) or a script file without any terminal
+ * or job-control setup and without prompts. The last command replaces
+ * dsh when possible; returns the status of the last job. */
+int run_script(FILE* in) {
+  job_t* j;
+  int c;
+  dsh_quiet = true;
+  forward_interrupts();
+  while (!dsh_interrupted && ((j = freadcmdline(in, "")) || !feof(in))) {
+    if (!j) continue;
+    bool last = (c = getc(in)) == EOF;
+    if (!last) ungetc(c, in);
+    run_jobs(j, last);
+    if (count_jobs() > MAX_HISTORY) delete_completed_job();
+  }
+  fclose(in);
+  /* a script that leaves "every" or "watch" entries behind keeps
+   * running them */
+  while (!dsh_interrupted && (schedule_pending() || watch_pending())) {
+    event_dispatch(-1);
+    delete_owned_jobs();
+  }
+  finish_queue();
+  free_the_program();
+  exit_if_interrupted();
+  return dsh_last_status;
+}
+
 int main(int argc, char* argv[])
 {
+  if (pipe2(chld_pipe, O_CLOEXEC | O_NONBLOCK) < 0 || !event_add(chld_pipe[0], reap_children, NULL)) {
+    perror("Couldn't set up the child reaper");
+    exit(EXIT_FAILURE);
+  }
   signal(SIGCHLD, &signal_chld);
+  signal(SIGPIPE, SIG_IGN); /* a pipeline relay may write to a stage that exited */
+  init_builtins();
+
+  int status;
+  if (argc == 3 && !strcmp(argv[1], "-m")) {
+    FILE* in = fopen(argv[2], "r");
+    if (!in) {
+      perror(argv[2]);
+      exit(127);
+    }
+    jobtable_open();
+    forward_interrupts();
+    status = run_incremental(in, argv[2]);
+    free_the_program();
+    exit_if_interrupted();
+    exit(status);
+  }
+  if (argc == 3 && (!strcmp(argv[1], "-p") || !strcmp(argv[1], "-P"))) {
+    load_rc();
+    status = run_replay(argv[2], argv[1][1] == 'P');
+    free_the_program();
+    exit(status);
+  }
+  if (argc == 3 && !strcmp(argv[1], "-r")) {
+    if (!session_record(argv[2])) exit(127);
+  } else if (argc > 1) {
+    FILE* in;
+    if (!strcmp(argv[1], "-c")) {
+      if (argc != 3) {
+        fprintf(stderr, "usage: dsh [-c cmdline | -m script | -r log | -p log | -P log | script]\n");
+        exit(2);
+      }
+      in = fmemopen(argv[2], strlen(argv[2]), "r");
+    } else {
+      in = fopen(argv[1], "r");
+    }
+    if (!in) {
+      perror(argv[1]);
+      exit(127);
+    }
+    exit(run_script(in));
+  }
 
 	init_dsh();
+	if (!dsh_is_interactive) forward_interrupts(); /* e.g. commands piped in */
+	jobtable_open();
+	load_rc();
 	DEBUG("Successfully initialized\n");
 
 
 	while(1) {
     job_t *j = NULL;
-		if(!(j = readcmdline(promptmsg()))) {
+    fputs(promptmsg(), stdout);
+    wait_input();
+		if(!(j = readcmdline(""))) {
 			if (feof(stdin)) { /* End of file (ctrl-d) */
 				fflush(stdout);
 				printf("\n");
         free_job(j);
+        finish_queue();
         free_the_program();
 				exit(EXIT_SUCCESS);
       }
@@ -422,12 +939,12 @@ int main(int argc, char* argv[])
             /* spawn_job(j,true) */
             /* else */
             /* spawn_job(j,false) */
-        append_jobs(j);
-        job_t* j_next;
-        for (job_t* ji = j; ji != NULL; ) {
-            j_next = ji->next;
-            run_job(ji);
-            ji = j_next;
+        run_jobs(j, false);
+        if (dsh_interrupted) {
+          finish_queue();
+          free_the_program();
+          exit_if_interrupted();
         }
+        if (count_jobs() > MAX_HISTORY) delete_completed_job();
     }
 }
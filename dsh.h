@@ -1,6 +1,10 @@
 #ifndef __DSH_H__         /* check if this header file is already defined elsewhere */
 #define __DSH_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE       /* pipe2(), splice() and friends */
+#endif
+
 #include <stdio.h>
 #include <sys/types.h>  /* pid_t */
 #include <unistd.h>     /* getpid()*/
@@ -11,6 +15,11 @@
 #include <string.h>     /* strncpy */
 #include <sys/stat.h>   /* file modes */
 #include <fcntl.h>      /* file open */
+#include <time.h>       /* clock_gettime() */
+#include <limits.h>     /* PATH_MAX */
+#include <stdint.h>     /* uint64_t */
+#include <sys/time.h>   /* timeradd */
+#include <sys/resource.h> /* struct rusage */
 
 /* Max length of input/output file name specified during I/O redirection */
 #define MAX_LEN_FILENAME 80
@@ -25,15 +34,34 @@
 #define INPUT_FD  1000
 #define OUTPUT_FD 1001
 
+#define ZSTREAM_CMD "dsh-gzip"   /* argv[0] of the stage dsh runs itself for .gz files */
+#define ZSTREAM_BLOCK (1 << 20) /* bytes deflated per thread at a time */
+
+#define OPTIMIZE_OFF 0
+#define OPTIMIZE_ON 1
+#define OPTIMIZE_VERBOSE 2
+
 #define MAX_HISTORY 20 /* flush the completed jobs after reaching the MAX_HISTORY */
 
 #define MAX_ARGS 20 /* Maximum number of arguments to any command */
 
 #define PRINT_INFO 1 /* FLAG for print_job() and other debug info */
 
-/* using bool as built-in; char is better in terms of space utilization, but
- * code is not succint */
-typedef enum { false, true } bool;
+#define CAPTURE_CHUNK 4096                   /* allocation unit of captured output */
+#define CAPTURE_JOB_MAX (64 * 1024)          /* captured bytes kept per background job */
+#define CAPTURE_TOTAL_MAX (4 * 1024 * 1024)  /* captured bytes kept over all jobs */
+
+#define CACHE_MAX_BYTES (256L * 1024 * 1024) /* size cap of the on-disk result cache */
+
+#define KILL_GRACE_SEC 5 /* seconds between SIGTERM and SIGKILL for an expired job */
+
+/* how far a job's deadline has escalated */
+#define DEADLINE_NONE 0 /* deadline not reached (or none set) */
+#define DEADLINE_TERM 1 /* SIGTERM sent to the process group */
+#define DEADLINE_KILL 2 /* SIGKILL sent after the grace period */
+
+/* bool from <stdbool.h>, the same type libdsh.h exports to its users */
+#include <stdbool.h>
 
 /* A process is a single process (a command to run an executable program).  */
 typedef struct process {
@@ -46,8 +74,16 @@ typedef struct process {
         int status;                 /* reported status value from job control; 0 on success and nonzero otherwise */
         char *ifile;                /* stores input file name when < is issued */
         char *ofile;                /* stores output file name when > is issued */
+        int heredoc;                /* sealed memfd holding a << or <<< text; -1 if none */
+        bool added;                 /* stage inserted by dsh (zstream.c), not typed by the user */
 } process_t;
 
+typedef struct capture capture_t; /* captured output of a background job (capture.c) */
+typedef struct meter meter_t;     /* relay statistics of one pipeline edge (meter.c) */
+typedef struct cache cache_t;     /* result cache entry being recorded (cache.c) */
+typedef struct schedule schedule_t; /* a periodic "every" entry (schedule.c) */
+typedef struct watch watch_t;     /* a "watch" entry (watch.c) */
+
 /* A job is a process itself or a pipeline of processes.
  * Each job has exactly one process group (pgid) containing all the processes in the job. 
  * Each process group has exactly one process that is its leader.
@@ -60,6 +96,21 @@ typedef struct job {
         bool notified;              /* true if user was informed about stopped job */
         int mystdin, mystdout, mystderr;  /* standard i/o channels */
         bool bg;                    /* true when & is issued on the command line */
+        int deadline;               /* seconds until SIGTERM; 0 for no deadline */
+        int deadline_fd;            /* timerfd backing the deadline; -1 if unarmed */
+        int expired;                /* DEADLINE_NONE, DEADLINE_TERM or DEADLINE_KILL */
+        capture_t *capture;         /* buffered output when captured; NULL otherwise */
+        meter_t *meters;            /* one per metered pipe edge, in pipeline order */
+        cache_t *cache;             /* set while the output is recorded for the cache */
+        time_t start;               /* wall clock time the job was spawned */
+        struct rusage rusage;       /* summed over the processes reaped so far */
+        int queued;                 /* ticket while waiting in the background queue; 0 otherwise */
+        int prio;                   /* queued jobs with a higher prio are started first */
+        bool waited;                /* its status was collected by the wait builtin */
+        int seqno;                  /* order in which the shell ran the job (session.c) */
+        double spawned;             /* monotonic_now() when the job was spawned */
+        schedule_t *schedule;       /* the "every" entry that launched it; NULL otherwise */
+        watch_t *watch;             /* the "watch" entry that launched it; NULL otherwise */
 } job_t;
 
 /* Finds a job for which the pgid is still -1 (indicates not processed);
@@ -75,6 +126,15 @@ bool job_is_completed(job_t *j);
 /* Find the last job.  */
 job_t *find_last_job();
 
+/* free_job iterates and invokes free on all its members */
+bool free_job(job_t *j);
+
+/* frees a single process that is no longer linked into a job */
+void free_process(process_t *p);
+
+/* copies a job as parsed, without any of its run state */
+job_t *clone_job(job_t *t);
+
 /* delete a given job j; We will simply loop from first_job since we do not
  * store prev pointer */
 void delete_job(job_t *j, job_t *first_job);
@@ -97,6 +157,172 @@ void seize_tty(pid_t callingprocess_pgid);
 /* checks whether haystack ends with needle */
 int endswith(const char* haystack, const char* needle);
 
+/* the executable execvp() would run for cmd, in path */
+bool find_in_path(const char *cmd, char *path, size_t len);
+
+/* drops the first n arguments of p, e.g. to consume a command prefix */
+void shift_argv(process_t *p, int n);
+
+/* drops the first n words of the command line s, to match shift_argv() */
+void drop_words(char *s, int n);
+
+/* seconds on the monotonic clock */
+double monotonic_now();
+
+/* the last stage the user typed, not counting stages dsh added */
+process_t *last_stage(job_t *j);
+/* exit status of that stage, 128+signal if it was killed or stopped */
+int job_status(job_t *j);
+
+/* 64-bit FNV-1a; start with h = FNV_OFFSET and chain calls */
+#define FNV_OFFSET 14695981039346656037ULL
+uint64_t hash_bytes(uint64_t h, const void *buf, size_t n);
+bool write_all(int fd, const void *buf, size_t n);
+
+extern int dsh_last_status; /* exit status of the last foreground job */
+extern bool dsh_quiet;      /* no launch messages (dsh -c and scripts) */
+extern int dsh_interrupted; /* signal that interrupted dsh -c, a script or -m; 0 if none */
+void forward_interrupts();
+
+/* The dsh wait loop (event.c): callbacks run when a registered fd becomes
+ * readable. event_dispatch() waits at most timeout_ms (-1 blocks). */
+typedef void (*event_cb)(int fd, void *arg);
+bool event_init();
+bool event_add(int fd, event_cb cb, void *arg);
+bool event_add_writable(int fd, event_cb cb, void *arg);
+void event_del(int fd);
+int event_dispatch(int timeout_ms);
+
+/* Per-job deadlines (deadline.c) */
+extern int dsh_default_deadline;
+bool deadline_prefix(job_t *j);
+bool deadline_start(job_t *j);
+void deadline_cancel(job_t *j);
+
+/* Output capture for background jobs (capture.c) */
+extern bool dsh_capture;
+int capture_start(job_t *j);
+void capture_print(job_t *j);
+void capture_replay(job_t *j);
+void capture_free(job_t *j);
+
+/* Per-edge pipeline metering (meter.c) */
+extern bool dsh_meter;
+int meter_edge(job_t *j, process_t *p, int upstream);
+void meter_print(job_t *j);
+void meter_finish(job_t *j);
+void meter_free(job_t *j);
+
+/* Result cache for deterministic commands (cache.c) */
+const char *dsh_cache_dir();
+bool cache_prefix(job_t *j);
+int cache_start(job_t *j);
+void cache_finish(job_t *j, int status);
+void cache_free(job_t *j);
+
+/* Running C sources as commands (autocc.c) */
+const char *compile_c(const char *src);
+
+/* Shared-memory job table for dshtop (jobtable.c) */
+void jobtable_open();
+void jobtable_publish(job_t *first_job);
+
+/* Background job queue (queue.c) */
+extern int dsh_queue_limit;
+extern bool dsh_queue_load;
+bool queue_job(job_t *j, job_t *first_job);
+void queue_start(job_t *j, bool fg);
+void queue_admit(job_t *first_job);
+bool queue_pending(job_t *first_job);
+void queue_cmd(job_t *first_job, int argc, char **argv);
+
+/* Pipeline rewriting before spawn (optimize.c) */
+extern int dsh_optimize;
+bool optimize_job(job_t *j);
+
+/* Compressed < and > redirections (zstream.c) */
+extern int dsh_zlevel;
+extern int dsh_zthreads;
+extern bool dsh_zverbose;
+void zstream_job(job_t *j);
+int zstream_main(int argc, char **argv);
+void compress_cmd(int argc, char **argv);
+
+/* Session record and replay (session.c) */
+bool session_record(const char *path);
+void session_line(const char *cmdline);
+void session_body(const char *line);
+void session_run(job_t *j);
+void session_job_done(job_t *j);
+int run_replay(const char *path, bool fast);
+
+/* Builtins, aliases and functions (names.c) */
+typedef void (*builtin_fn)(job_t *j, int argc, char **argv);
+void builtin_register(const char *name, builtin_fn fn);
+builtin_fn builtin_lookup(const char *name);
+bool is_builtin(const char *name);
+bool alias_expand(job_t *j);
+void alias_cmd(job_t *j, int argc, char **argv);
+void function_cmd(job_t *j, int argc, char **argv);
+bool function_call(int argc, char **argv);
+
+/* Periodic jobs, "every" (schedule.c) */
+#define SCHEDULE_SKIP 0  /* a run due while the last one runs is dropped */
+#define SCHEDULE_QUEUE 1 /* ... starts when the last one is done */
+#define SCHEDULE_ALLOW 2 /* ... starts anyway */
+void every_cmd(job_t *j, int argc, char **argv);
+void schedule_done(job_t *j);
+void schedule_free(job_t *j);
+bool schedule_pending();
+
+/* Re-running jobs when their inputs change, "watch" (watch.c) */
+#define WATCH_SETTLE_MS 100 /* quiet time after a change before the job reruns */
+void watch_cmd(job_t *j, int argc, char **argv);
+void watch_done(job_t *j);
+void watch_free(job_t *j);
+bool watch_pending();
+
+/* Predictive exec prefetch (prefetch.c) */
+#define PREFETCH_FANOUT 2          /* likely next commands warmed per job */
+#define PREFETCH_LIBS 32           /* shared libraries warmed per executable */
+#define PREFETCH_BUDGET (64 << 20) /* bytes advised per prediction */
+extern bool dsh_prefetch;
+void prefetch_job(job_t *j);
+void prefetch_warm();
+void prefetch_cmd(int argc, char **argv);
+
+/* Incremental batch execution, dsh -m (batch.c) */
+#define JOURNAL_SYNC_MS 200 /* the completion journal is fsync()ed at most this often */
+int run_incremental(FILE *in, const char *script);
+
+/* Forking a parsed job (libdsh.c), shared by dsh and the library. edge
+ * may put something on the pipe after p and returns the fd the next
+ * stage reads (meter_edge()); child runs in each child as soon as it is
+ * in the job's process group; exec replaces the plain execvp(). All are
+ * optional. */
+typedef struct job_ops {
+        int (*edge)(job_t *j, process_t *p, int upstream);
+        void (*child)(job_t *j, process_t *p, void *arg);
+        void (*exec)(job_t *j, process_t *p, void *arg);
+        void *arg;
+} job_ops_t;
+bool job_fork(job_t *j, int in, int out, int err, const job_ops_t *ops);
+void redirect_io(job_t *j, process_t *p);
+
+/* Job control entry points (dsh.c) */
+void init_builtins();
+bool source_file(const char *path, bool must_exist);
+void run_job(job_t *j, bool last);
+void exec_process(process_t *p);
+void spawn_job(job_t *j, bool fg);
+void append_jobs(job_t *j);
+void run_jobs(job_t *j, bool last);
+void stable_delete_job(job_t *j);
+void delete_completed_job();
+void delete_owned_jobs();
+int count_jobs();
+bool jobs_running();
+
 /* Basic parser that fills the data structures job_t and process_t defined in
  * dsh.h. We tried to make the parser flexible but it is not tested
  * with arbitrary inputs. Be prepared to hack it for the features
@@ -105,10 +331,19 @@ int endswith(const char* haystack, const char* needle);
  * will always return NULL. 
  *
  * The parser supports these symbols: <, >, |, &, ;
+ *
+ * parse_stream() reads one command line from in (parse.c); line and body,
+ * if not NULL, see the command line and every here-document line read.
  */
+typedef void (*parse_echo_fn)(const char *line);
+job_t* parse_stream(FILE *in, parse_echo_fn line, parse_echo_fn body);
 
+/* prints msg, then parses a command line from stdin (dsh.c) */
 job_t* readcmdline(char *msg);
 
+/* Same as readcmdline(), but reads the command line from in */
+job_t* freadcmdline(FILE *in, char *msg);
+
 #ifdef NDEBUG
         #define DEBUG(M, ...)
 #else
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "jobtable.h"
+
+/* dshtop: shows the jobs of every running dsh on this host. Each dsh
+ * publishes its job table in /dev/shm/dsh.<pid> (see jobtable.h); dshtop
+ * maps those read-only and copies them under the seqlock, so a refresh
+ * costs one small copy per dsh no matter how many processes the jobs
+ * have, and never makes a dsh wait.
+ *
+ * usage: dshtop [-1] [interval]   (-1: print once and exit)
+ */
+
+#define SHM_DIR "/dev/shm"
+
+/* consistent snapshot of a table that may be written concurrently */
+static int snapshot(const jobtable_t *shared, jobtable_t *copy)
+{
+	uint32_t before, after;
+	int tries;
+
+	for(tries = 0; tries < 1000; tries++) {
+		before = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+		if(before & 1)
+			continue; /* writer in progress */
+		memcpy(copy, shared, sizeof(jobtable_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&shared->seq, __ATOMIC_RELAXED);
+		if(before == after)
+			return 1;
+	}
+	return 0;
+}
+
+static void show_table(const jobtable_t *t, time_t now)
+{
+	int i, k;
+
+	printf("dsh %d: %d job(s)%s\n", t->owner, t->ntotal,
+		t->ntotal > t->njobs ? " (list truncated)" : "");
+	for(i = 0; i < t->njobs && i < JOBTABLE_JOBS; i++) {
+		const jobtable_job_t *j = &t->jobs[i];
+		char pids[JOBTABLE_PIDS * 12] = "";
+		size_t len = 0;
+		for(k = 0; k < j->npids && k < JOBTABLE_PIDS; k++)
+			len += snprintf(pids + len, sizeof(pids) - len, k ? ",%d" : "%d", j->pids[k]);
+		printf("  %7d %c%c %6lds %8.2fs %8.2fs %8ldK  %-20s %.*s\n",
+			j->pgid, j->state, j->bg ? '&' : ' ',
+			(long)(now - j->start),
+			j->utime_us / 1e6, j->stime_us / 1e6, (long)j->maxrss_kb,
+			pids, JOBTABLE_CMDLEN, j->cmd);
+	}
+}
+
+static void refresh()
+{
+	DIR *d;
+	struct dirent *e;
+	jobtable_t copy;
+	time_t now = time(NULL);
+	int shells = 0;
+
+	if(!(d = opendir(SHM_DIR))) {
+		perror(SHM_DIR);
+		exit(EXIT_FAILURE);
+	}
+	printf("   PGID ST    AGE     USER      SYS   MAXRSS  PIDS                 COMMAND\n");
+	while((e = readdir(d))) {
+		char path[sizeof(SHM_DIR) + 256];
+		const jobtable_t *shared;
+		int fd;
+
+		if(strncmp(e->d_name, JOBTABLE_PREFIX, strlen(JOBTABLE_PREFIX)))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", SHM_DIR, e->d_name);
+		if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+		shared = (const jobtable_t *)mmap(NULL, sizeof(jobtable_t), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(shared == MAP_FAILED)
+			continue;
+		if(__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) == JOBTABLE_MAGIC
+			&& snapshot(shared, &copy)) {
+			if(kill(copy.owner, 0) == 0 || errno == EPERM) {
+				show_table(&copy, now);
+				++shells;
+			} else if(errno == ESRCH) {
+				unlink(path); /* left behind by a dsh that was killed */
+			}
+		}
+		munmap((void *)shared, sizeof(jobtable_t));
+	}
+	closedir(d);
+	printf("%d dsh instance(s)\n", shells);
+}
+
+int main(int argc, char *argv[])
+{
+	int once = 0, interval = 1, i;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-1"))
+			once = 1;
+		else if(atoi(argv[i]) > 0)
+			interval = atoi(argv[i]);
+		else {
+			fprintf(stderr, "usage: dshtop [-1] [interval]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(;;) {
+		if(!once)
+			printf("\033[H\033[J"); /* clear the screen */
+		refresh();
+		fflush(stdout);
+		if(once)
+			return 0;
+		sleep(interval);
+	}
+}
@@ -0,0 +1,107 @@
+#include "dsh.h"
+#include <sys/epoll.h>
+
+/* The dsh wait loop. Every fd dsh has to watch (the child-reaper pipe,
+ * job deadline timers, pipeline relays, ...) is registered here with a
+ * callback, and event_dispatch() blocks in epoll_wait() until one of them
+ * fires. This keeps dsh single-threaded and lets any number of jobs carry
+ * their own fds without polling. */
+
+typedef struct event {
+	event_cb cb;    /* NULL when the slot is free */
+	void *arg;
+} event_t;
+
+static int epfd = -1;
+static event_t *events = NULL; /* indexed by fd */
+static int nevents = 0;
+
+bool event_init()
+{
+	if(epfd >= 0)
+		return true;
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return false;
+	}
+	return true;
+}
+
+static bool event_register(int fd, uint32_t mask, event_cb cb, void *arg)
+{
+	struct epoll_event ev;
+
+	if(fd < 0 || !event_init())
+		return false;
+	if(fd >= nevents) {
+		int n = nevents ? nevents : 16;
+		while(n <= fd)
+			n *= 2;
+		event_t *grown = (event_t *)realloc(events, n * sizeof(event_t));
+		if(!grown) {
+			fprintf(stderr, "%s\n","malloc: no space");
+			return false;
+		}
+		memset(grown + nevents, 0, (n - nevents) * sizeof(event_t));
+		events = grown;
+		nevents = n;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = mask;
+	ev.data.fd = fd;
+	if(epoll_ctl(epfd, events[fd].cb ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+	events[fd].cb = cb;
+	events[fd].arg = arg;
+	return true;
+}
+
+/* register fd for readability; arg is handed back to cb untouched */
+bool event_add(int fd, event_cb cb, void *arg)
+{
+	return event_register(fd, EPOLLIN, cb, arg);
+}
+
+/* register fd for writability, e.g. to learn when a full pipe drained */
+bool event_add_writable(int fd, event_cb cb, void *arg)
+{
+	return event_register(fd, EPOLLOUT, cb, arg);
+}
+
+/* forget fd; must be called before fd is closed */
+void event_del(int fd)
+{
+	if(fd < 0 || fd >= nevents || !events[fd].cb)
+		return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	events[fd].cb = NULL;
+	events[fd].arg = NULL;
+}
+
+/* Wait up to timeout_ms (-1 blocks) and run the callbacks of the fds that
+ * became ready. Returns the number of callbacks run. */
+int event_dispatch(int timeout_ms)
+{
+	struct epoll_event ready[64];
+	int n, i, ran = 0;
+
+	if(!event_init())
+		return 0;
+	if((n = epoll_wait(epfd, ready, 64, timeout_ms)) < 0) {
+		if(errno != EINTR)
+			perror("epoll_wait");
+		return 0;
+	}
+	for(i = 0; i < n; i++) {
+		int fd = ready[i].data.fd;
+		/* an earlier callback in this round may have removed fd */
+		if(fd >= nevents || !events[fd].cb)
+			continue;
+		events[fd].cb(fd, events[fd].arg);
+		++ran;
+	}
+	return ran;
+}
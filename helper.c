@@ -1,9 +1,5 @@
 #include "dsh.h"
 
-pid_t dsh_pgid;         /* process group id of dsh */
-int dsh_terminal_fd;    /* terminal file descriptor of dsh */
-int dsh_is_interactive; /* interactive or batch mode */
-
 /* Return true if all processes in the job have stopped or completed.  */
 bool job_is_stopped(job_t *j) 
 {
@@ -52,24 +48,83 @@ bool free_job(job_t *j)
 {
 	if(!j)
 		return true;
+	deadline_cancel(j);
+	capture_free(j);
+	meter_free(j);
+	cache_free(j);
+	schedule_free(j);
+	watch_free(j);
 	free(j->commandinfo);
 	process_t *p;
 	process_t *p_next;
 	for(p = j->first_process; p;) {
-		int i;
 		p_next = p->next;
-		for(i = 0; i < p->argc; i++)
-			free(p->argv[i]);
-		free(p->argv);
-        	free(p->ifile);
-        	free(p->ofile);
-		free(p);
+		free_process(p);
 		p = p_next;
 	}
 	free(j);
 	return true;
 }
 
+/* Deep copy of a job as it was parsed, e.g. to run a function body
+ * (names.c); none of the run state is copied. NULL if out of memory. */
+job_t *clone_job(job_t *t)
+{
+	job_t *j = (job_t *)malloc(sizeof(job_t));
+	process_t *tp, *p, **link;
+	int i;
+
+	if(!j || !init_job(j)) {
+		free(j);
+		fprintf(stderr, "%s\n","malloc: no space");
+		return NULL;
+	}
+	memcpy(j->commandinfo, t->commandinfo, MAX_LEN_CMDLINE);
+	j->mystdin = t->mystdin;
+	j->mystdout = t->mystdout;
+	j->mystderr = t->mystderr;
+	j->bg = t->bg;
+	j->deadline = t->deadline;
+	j->prio = t->prio;
+	link = &j->first_process;
+	for(tp = t->first_process; tp; tp = tp->next) {
+		if(!(p = (process_t *)malloc(sizeof(process_t))) || !init_process(p)) {
+			free(p);
+			free_job(j);
+			fprintf(stderr, "%s\n","malloc: no space");
+			return NULL;
+		}
+		*link = p;
+		link = &p->next;
+		for(i = 0; i < tp->argc; i++)
+			p->argv[i] = strdup(tp->argv[i]);
+		p->argc = tp->argc;
+		p->ifile = tp->ifile ? strdup(tp->ifile) : NULL;
+		p->ofile = tp->ofile ? strdup(tp->ofile) : NULL;
+		p->added = tp->added;
+		if(tp->heredoc >= 0) {
+			/* a new open file description, so each copy reads from the start */
+			char path[64];
+			snprintf(path, sizeof(path), "/proc/self/fd/%d", tp->heredoc);
+			p->heredoc = open(path, O_RDONLY | O_CLOEXEC);
+		}
+	}
+	return j;
+}
+
+void free_process(process_t *p)
+{
+	int i;
+	for(i = 0; i < p->argc; i++)
+		free(p->argv[i]);
+	free(p->argv);
+	free(p->ifile);
+	free(p->ofile);
+	if(p->heredoc >= 0)
+		close(p->heredoc);
+	free(p);
+}
+
 
 /* delete a given job j; We will simply loop from first_job since we do not
  * store prev pointer */
@@ -112,55 +167,116 @@ int endswith(const char* haystack, const char* needle)
 	return (strcmp(&haystack[hlen-nlen], needle)) == 0;
 }
 
-void seize_tty(pid_t callingprocess_pgid)
+/* Resolves cmd the way execvp() would: through PATH unless it contains a
+ * slash. False if there is no such executable. */
+bool find_in_path(const char *cmd, char *path, size_t len)
 {
-	/* Grab control of the terminal.  */
-	/* Don't call this until other initialization is complete */
-  if (dsh_is_interactive) {
-	if(tcsetpgrp(STDIN_FILENO, callingprocess_pgid) < 0) {
-		perror("tcsetpgrp failure (see note in the lab2 FAQ)");
-		exit(EXIT_FAILURE);
+	const char *dirs = getenv("PATH");
+
+	if(strchr(cmd, '/')) {
+		snprintf(path, len, "%s", cmd);
+		return access(path, X_OK) == 0;
 	}
-  }
+	while(dirs && *dirs) {
+		size_t n = strcspn(dirs, ":");
+		snprintf(path, len, "%.*s/%s", (int)n, dirs, cmd);
+		if(access(path, X_OK) == 0)
+			return true;
+		dirs += n + (dirs[n] == ':');
+	}
+	return false;
 }
 
-/* If dsh is running interactively as the foreground job
- * then set the process group and signal handlers
- * */
+/* drops the first n words of the command line s, to match shift_argv() */
+void drop_words(char *s, int n)
+{
+	char *p = s;
+	while(n-- > 0) {
+		p += strspn(p, " \t");
+		p += strcspn(p, " \t");
+	}
+	p += strspn(p, " \t");
+	memmove(s, p, strlen(p) + 1);
+}
 
-void init_dsh() 
+/* drops the first n arguments of p, e.g. to consume a command prefix */
+void shift_argv(process_t *p, int n)
 {
+	int i;
+	if(n > p->argc)
+		n = p->argc;
+	for(i = 0; i < n; i++)
+		free(p->argv[i]);
+	memmove(p->argv, p->argv + n, (p->argc - n + 1) * sizeof(char *));
+	p->argc -= n;
+	for(i = p->argc + 1; i <= p->argc + n && i < MAX_ARGS; i++)
+		p->argv[i] = NULL;
+}
 
-	dsh_terminal_fd = STDIN_FILENO;
+/* seconds on the monotonic clock */
+double monotonic_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	/* isatty(): test whether a file descriptor refers to a terminal 
-	 * isatty() returns 1 if fd is an open file descriptor referring to a
- 	 * terminal; otherwise 0 is returned, and errno is set to indicate the error.
- 	 * */
-	dsh_is_interactive = isatty(dsh_terminal_fd);
+/* the last stage of the command line as typed; stages that dsh added
+ * after it (compressors) do not count */
+process_t *last_stage(job_t *j)
+{
+	process_t *p, *last = j->first_process;
+	for(p = j->first_process; p; p = p->next)
+		if(!p->added)
+			last = p;
+	return last;
+}
 
-  	/* See if we are running interactively.  */
-	if(dsh_is_interactive) {
-		/* Loop until we are in the foreground.  */
-		while(tcgetpgrp(dsh_terminal_fd) != (dsh_pgid = getpgrp()))
-			kill(- dsh_pgid, SIGTTIN); /* Request for terminal input */
+/* The exit status of the user's last stage, 128+signal if it was killed
+ * or stopped. If that succeeded but a stage dsh
+ * added after it failed, the output is incomplete and that failure is
+ * reported instead. */
+int job_status(job_t *j)
+{
+	process_t *p = last_stage(j), *q;
+	for(q = p->next; q && p->status == 0; q = q->next)
+		if(q->status != 0)
+			p = q;
+	if(WIFEXITED(p->status))
+		return WEXITSTATUS(p->status);
+	if(WIFSIGNALED(p->status))
+		return 128 + WTERMSIG(p->status);
+	if(WIFSTOPPED(p->status))
+		return 128 + WSTOPSIG(p->status);
+	return p->status;
+}
 
-		/* Ignore interactive and job-control signals.
-		* If tcsetpgrp() is called by a member of a background process 
-		* group in its session, and the calling process is not blocking or
-		* ignoring SIGTTOU,  a SIGTTOU signal is sent to all members of 
-		* this background process group.
-		*/
-		signal(SIGTTOU, SIG_IGN);
+/* 64-bit FNV-1a; start with h = FNV_OFFSET and chain calls */
+uint64_t hash_bytes(uint64_t h, const void *buf, size_t n)
+{
+	const unsigned char *b = (const unsigned char *)buf;
+	while(n--) {
+		h ^= *b++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
 
-		/* Put the dsh in our own process group.  */
-		dsh_pgid = getpid();
-		if(setpgid(dsh_pgid, dsh_pgid) < 0) {
-			perror("Couldn't put the dsh in its own process group");
-			exit(EXIT_FAILURE);
+/* write() all of buf, retrying short writes and EINTR */
+bool write_all(int fd, const void *buf, size_t n)
+{
+	const char *b = (const char *)buf;
+	ssize_t w;
+	while(n > 0) {
+		if((w = write(fd, b, n)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return false;
 		}
-		seize_tty(dsh_pgid);
-	} 
+		b += w;
+		n -= w;
+	}
+	return true;
 }
 
 /* Prints the jobs in the list.  */
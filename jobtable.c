@@ -0,0 +1,87 @@
+#include "dsh.h"
+#include "jobtable.h"
+#include <sys/mman.h>
+
+/* Publishes the job list in shared memory for dshtop. dsh is the only
+ * writer; see jobtable.h for the layout and the seqlock protocol. */
+
+static jobtable_t *table = NULL;
+static char shm_name[32];
+
+static void jobtable_close()
+{
+	if(!table)
+		return;
+	munmap(table, sizeof(jobtable_t));
+	shm_unlink(shm_name);
+	table = NULL;
+}
+
+/* create /dev/shm/dsh.<pid>, readable by our user only since it holds
+ * command lines; dsh works the same without it */
+void jobtable_open()
+{
+	int fd;
+	void *mem;
+
+	snprintf(shm_name, sizeof(shm_name), JOBTABLE_NAME, getpid());
+	if((fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+		return;
+	if(ftruncate(fd, sizeof(jobtable_t)) < 0
+		|| (mem = mmap(NULL, sizeof(jobtable_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		shm_unlink(shm_name);
+		return;
+	}
+	close(fd);
+	table = (jobtable_t *)mem;
+	table->owner = getpid();
+	__atomic_store_n(&table->magic, JOBTABLE_MAGIC, __ATOMIC_RELEASE);
+	atexit(jobtable_close);
+}
+
+static int64_t tv_us(struct timeval tv)
+{
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* rewrite the table from the job list starting at first_job */
+void jobtable_publish(job_t *first_job)
+{
+	job_t *j;
+	process_t *p;
+	int n = 0, total = 0;
+	uint32_t seq;
+
+	if(!table)
+		return;
+	seq = table->seq;
+	__atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(j = first_job; j; j = j->next) {
+		if(j->pgid == -1)
+			continue; /* builtins and jobs not started yet */
+		if(++total > JOBTABLE_JOBS)
+			continue;
+		jobtable_job_t *t = &table->jobs[n++];
+		t->pgid = j->pgid;
+		t->npids = 0;
+		for(p = j->first_process; p && t->npids < JOBTABLE_PIDS; p = p->next)
+			t->pids[t->npids++] = p->pid;
+		if(job_is_completed(j))
+			t->state = j->expired != DEADLINE_NONE ? 'T' : 'D';
+		else
+			t->state = job_is_stopped(j) ? 'S' : 'R';
+		t->bg = j->bg;
+		t->start = j->start;
+		t->utime_us = tv_us(j->rusage.ru_utime);
+		t->stime_us = tv_us(j->rusage.ru_stime);
+		t->maxrss_kb = j->rusage.ru_maxrss;
+		snprintf(t->cmd, sizeof(t->cmd), "%s", j->commandinfo);
+	}
+	table->njobs = n;
+	table->ntotal = total;
+
+	__atomic_store_n(&table->seq, seq + 2, __ATOMIC_RELEASE);
+}
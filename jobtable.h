@@ -0,0 +1,43 @@
+#ifndef __JOBTABLE_H__     /* check if this header file is already defined elsewhere */
+#define __JOBTABLE_H__
+
+#include <stdint.h>
+
+/* Layout of the shared-memory job table every dsh publishes as
+ * /dev/shm/dsh.<pid> (see jobtable.c) and dshtop reads. The layout is
+ * fixed so readers never need to allocate or follow pointers.
+ *
+ * The table is guarded by a seqlock: dsh makes seq odd before it writes
+ * and even again afterwards. A reader copies the table, and retries if seq
+ * was odd or changed while it copied, so readers never block the shell. */
+
+#define JOBTABLE_NAME "/dsh.%d"   /* shm_open() name; %d is the dsh pid */
+#define JOBTABLE_PREFIX "dsh."    /* file name prefix under /dev/shm */
+#define JOBTABLE_MAGIC 0x64736801 /* "dsh" + layout version */
+
+#define JOBTABLE_JOBS 64          /* jobs published per dsh */
+#define JOBTABLE_PIDS 8           /* pids published per job */
+#define JOBTABLE_CMDLEN 120       /* same as MAX_LEN_CMDLINE */
+
+typedef struct jobtable_job {
+	int32_t pgid;
+	int32_t npids;
+	int32_t pids[JOBTABLE_PIDS];
+	char state;                   /* 'R'unning, 'S'topped, 'D'one, 'T'imed out */
+	char bg;
+	int64_t start;                /* wall clock seconds */
+	int64_t utime_us, stime_us;   /* of the processes reaped so far */
+	int64_t maxrss_kb;
+	char cmd[JOBTABLE_CMDLEN];
+} jobtable_job_t;
+
+typedef struct jobtable {
+	uint32_t magic;
+	uint32_t seq;                 /* seqlock */
+	int32_t owner;                /* pid of the dsh */
+	int32_t njobs;
+	int32_t ntotal;               /* jobs dsh knows of; may exceed JOBTABLE_JOBS */
+	jobtable_job_t jobs[JOBTABLE_JOBS];
+} jobtable_t;
+
+#endif /* __JOBTABLE_H__ */
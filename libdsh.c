@@ -0,0 +1,283 @@
+#include "dsh.h"
+#include "libdsh.h"
+
+/* libdsh: the parser, the job model and the forking of pipelines, with no
+ * global state, so other programs can run command lines without starting
+ * /bin/sh (see libdsh.h). The dsh program forks its jobs through
+ * job_fork() as well and adds the terminal, the wait loop and its job
+ * extensions on top. It does not go through a dsh_t, though: its job list
+ * and mode (first_j, dsh_is_interactive, ...) are still globals in dsh.c. */
+
+_Static_assert(LIBDSH_MAX_JOBS == MAX_LEN_CMDLINE / 2, "one job needs at least two characters");
+
+struct dsh {
+	job_t *first_job;   /* parsed and not yet released */
+};
+
+/* The job extensions of the dsh program (deadlines, output capture,
+ * metering, the result cache, "every" and "watch" runs) are never set up
+ * on jobs run through the library, but free_job() releases them. These empty weak definitions let
+ * a program link libdsh.a alone; in dsh the real ones take precedence. */
+__attribute__((weak)) void deadline_cancel(job_t *j) {}
+__attribute__((weak)) void capture_free(job_t *j) {}
+__attribute__((weak)) void meter_free(job_t *j) {}
+__attribute__((weak)) void cache_free(job_t *j) {}
+__attribute__((weak)) void schedule_free(job_t *j) {}
+__attribute__((weak)) void watch_free(job_t *j) {}
+
+/* Applies the < and > redirections of p to the calling process; only
+ * ever called in the process that is about to exec p */
+void redirect_io(job_t *j, process_t *p)
+{
+	int fd;
+
+	if(j->mystdin == INPUT_FD && p->ifile != NULL) {
+		if((fd = open(p->ifile, O_RDONLY, 0)) < 0) {
+			perror("Couldn't open input file");
+			_exit(EXIT_FAILURE);
+		}
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+	if(p->heredoc >= 0)
+		dup2(p->heredoc, STDIN_FILENO); /* the memfd itself is close-on-exec */
+	if(j->mystdout == OUTPUT_FD && p->ofile != NULL && p->next == NULL) {
+		if((fd = open(p->ofile, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+			perror("Couldn't open the output file");
+			_exit(EXIT_FAILURE);
+		}
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+}
+
+/* joins the job's process group; the first process founds it */
+static void set_pgid(job_t *j, process_t *p)
+{
+	if(j->pgid < 0)
+		j->pgid = p->pid;
+	setpgid(p->pid, j->pgid);
+}
+
+/* Forks the stages of j into one new process group, connected by pipes.
+ * in, out and err (-1: inherit) become the stdin of the first stage, the
+ * stdout of the last and the stderr of all of them, before the < and >
+ * redirections apply. Both parent and child put the child into the
+ * process group, so neither can run ahead of it. Returns false if a pipe
+ * or fork fails; the stages started by then are left running. */
+bool job_fork(job_t *j, int in, int out, int err, const job_ops_t *ops)
+{
+	process_t *p;
+	int input = in, fd[2] = {-1, -1};
+	bool ok = true;
+
+	for(p = j->first_process; p; p = p->next) {
+		if(p->next && pipe2(fd, O_CLOEXEC) < 0) {
+			perror("pipe");
+			ok = false;
+			break;
+		}
+		fflush(stdout); /* or a child that never execs may flush our buffered output again */
+		switch(p->pid = fork()) {
+		case -1:
+			perror("fork");
+			if(p->next) {
+				close(fd[0]);
+				close(fd[1]);
+			}
+			ok = false;
+			break;
+		case 0:
+			p->pid = getpid();
+			set_pgid(j, p);
+			if(ops && ops->child)
+				ops->child(j, p, ops->arg);
+			signal(SIGTTOU, SIG_DFL);
+			signal(SIGPIPE, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			if(input >= 0 && input != STDIN_FILENO)
+				dup2(input, STDIN_FILENO);
+			if(p->next)
+				dup2(fd[1], STDOUT_FILENO);
+			else if(out >= 0 && out != STDOUT_FILENO)
+				dup2(out, STDOUT_FILENO);
+			if(err >= 0 && err != STDERR_FILENO)
+				dup2(err, STDERR_FILENO);
+			redirect_io(j, p);
+			if(ops && ops->exec)
+				ops->exec(j, p, ops->arg);
+			execvp(p->argv[0], p->argv);
+			perror(p->argv[0]);
+			_exit(127);
+		default:
+			set_pgid(j, p);
+			if(p != j->first_process)
+				close(input);
+			if(p->next) {
+				close(fd[1]);
+				input = ops && ops->edge ? ops->edge(j, p, fd[0]) : fd[0];
+			}
+		}
+		if(!ok)
+			break;
+	}
+	if(!ok && p != j->first_process)
+		close(input);
+	for(p = j->first_process; p; p = p->next) {
+		if(p->heredoc >= 0) { /* every child has its copy by now */
+			close(p->heredoc);
+			p->heredoc = -1;
+		}
+	}
+	return ok;
+}
+
+dsh_t *dsh_open(void)
+{
+	return (dsh_t *)calloc(1, sizeof(dsh_t));
+}
+
+void dsh_close(dsh_t *d)
+{
+	if(!d)
+		return;
+	while(d->first_job)
+		dsh_release(d, d->first_job);
+	free(d);
+}
+
+int dsh_parse(dsh_t *d, const char *cmdline, job_t **jobs, int max)
+{
+	job_t *first, *j, **tail;
+	FILE *in;
+	int n = 0;
+
+	if(!*cmdline)
+		return 0;
+	if(strcspn(cmdline, "\n") >= MAX_LEN_CMDLINE) {
+		fprintf(stderr, "%s\n","reading cmdline: length exceeds the max limit");
+		return 0;
+	}
+	if(!(in = fmemopen((void *)cmdline, strlen(cmdline), "r"))) {
+		perror("fmemopen");
+		return 0;
+	}
+	first = parse_stream(in, NULL, NULL);
+	fclose(in);
+
+	for(j = first; j; j = j->next)
+		++n;
+	if(n > max) {
+		fprintf(stderr, "dsh_parse: more than %d jobs\n", max);
+		for(; first; first = j) {
+			j = first->next;
+			free_job(first);
+		}
+		return 0;
+	}
+	for(tail = &d->first_job; *tail; tail = &(*tail)->next);
+	*tail = first;
+	for(n = 0, j = first; j; j = j->next)
+		jobs[n++] = j;
+	return n;
+}
+
+/* waits for the processes of j that are still running; options is 0 or
+ * WNOHANG. True once they all completed. */
+static bool reap(job_t *j, int options)
+{
+	process_t *p;
+	pid_t pid;
+	int status;
+
+	for(p = j->first_process; p; p = p->next) {
+		if(p->completed)
+			continue;
+		while((pid = waitpid(p->pid, &status, options)) < 0 && errno == EINTR);
+		if(pid == p->pid) {
+			p->status = status;
+			p->completed = true;
+		} else if(pid < 0) {
+			p->completed = true; /* not ours to wait for any more */
+		}
+	}
+	return job_is_completed(j);
+}
+
+bool dsh_spawn(dsh_t *d, job_t *j, int in, int out, int err)
+{
+	process_t *p;
+
+	if(j->pgid >= 0) {
+		fprintf(stderr, "dsh_spawn: %s: already spawned\n", j->commandinfo);
+		return false;
+	}
+	for(p = j->first_process; p; p = p->next)
+		if(p->argc == 0) {
+			fprintf(stderr, "%s\n","reading cmdline: empty command");
+			return false;
+		}
+	if(job_fork(j, in, out, err, NULL))
+		return true;
+
+	/* take down the part of the pipeline that did start */
+	for(p = j->first_process; p; p = p->next)
+		if(p->pid <= 0)
+			p->completed = true;
+	if(j->pgid > 0) {
+		kill(-j->pgid, SIGKILL);
+		reap(j, 0);
+	}
+	return false;
+}
+
+int dsh_poll(dsh_t *d, job_t *j)
+{
+	if(j->pgid < 0 || !reap(j, WNOHANG))
+		return -1;
+	return job_status(j);
+}
+
+int dsh_wait(dsh_t *d, job_t *j)
+{
+	if(j->pgid < 0)
+		return -1;
+	reap(j, 0);
+	return job_status(j);
+}
+
+void dsh_release(dsh_t *d, job_t *j)
+{
+	job_t **link;
+
+	if(j->pgid > 0 && !job_is_completed(j)) {
+		kill(-j->pgid, SIGKILL);
+		reap(j, 0);
+	}
+	for(link = &d->first_job; *link; link = &(*link)->next)
+		if(*link == j) {
+			*link = j->next;
+			break;
+		}
+	free_job(j);
+}
+
+int dsh_system(dsh_t *d, const char *cmdline)
+{
+	job_t *jobs[LIBDSH_MAX_JOBS];
+	int i, n, status = -1;
+
+	n = dsh_parse(d, cmdline, jobs, LIBDSH_MAX_JOBS);
+	for(i = 0; i < n; i++) {
+		if(!dsh_spawn(d, jobs[i], -1, -1, -1)) {
+			dsh_release(d, jobs[i]);
+			continue;
+		}
+		if(jobs[i]->bg)
+			continue;
+		status = dsh_wait(d, jobs[i]);
+		dsh_release(d, jobs[i]);
+	}
+	return status;
+}
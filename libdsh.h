@@ -0,0 +1,70 @@
+#ifndef __LIBDSH_H__
+#define __LIBDSH_H__
+
+#include <stdbool.h>
+
+/* libdsh: running dsh command lines from another program without a
+ * shell in between. Link with libdsh.a (see the Makefile).
+ *
+ *	dsh_t *d = dsh_open();
+ *	job_t *jobs[LIBDSH_MAX_JOBS];
+ *	int i, n = dsh_parse(d, "sort < in | uniq -c > out", jobs, LIBDSH_MAX_JOBS);
+ *	for(i = 0; i < n; i++)
+ *		if(dsh_spawn(d, jobs[i], -1, -1, -1))
+ *			status = dsh_wait(d, jobs[i]);
+ *	dsh_close(d);
+ *
+ * All state lives in the dsh_t, so independent contexts can be used
+ * side by side. Only external commands run; the dsh builtins, aliases and
+ * prefixes (deadline, cache, ...) belong to the dsh program. Every job
+ * gets its own process group. Children are reaped by pid, so the caller's
+ * other children are left alone.
+ *
+ * This header stands alone: both types are opaque, and it can be used
+ * from C++. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dsh dsh_t;
+typedef struct job job_t; /* a parsed job, owned by the dsh_t it came from */
+
+/* a command line cannot hold more jobs than this */
+#define LIBDSH_MAX_JOBS 60
+
+/* a new context; NULL if out of memory */
+dsh_t *dsh_open(void);
+
+/* kills whatever is still running, reaps it and frees every job */
+void dsh_close(dsh_t *d);
+
+/* Parses cmdline (one line, then the bodies of its here-documents) into
+ * at most max jobs, which stay owned by d. Returns the number of jobs; 0
+ * for an empty line or a parse error, which is reported on stderr. */
+int dsh_parse(dsh_t *d, const char *cmdline, job_t **jobs, int max);
+
+/* Starts j. in becomes the stdin of its first stage, out the stdout of
+ * its last and err the stderr of all stages (-1: inherit ours), before
+ * the < and > redirections apply. They are not closed; pass them
+ * close-on-exec so the children do not hold extra copies. */
+bool dsh_spawn(dsh_t *d, job_t *j, int in, int out, int err);
+
+/* exit status of a spawned job (128+signal if it was killed), or -1
+ * while it is still running; dsh_poll() never blocks */
+int dsh_poll(dsh_t *d, job_t *j);
+int dsh_wait(dsh_t *d, job_t *j);
+
+/* kills j if it is still running, reaps it and frees it */
+void dsh_release(dsh_t *d, job_t *j);
+
+/* system() without /bin/sh: runs cmdline with our stdio and returns the
+ * exit status of its last foreground job (-1 if nothing ran). Background
+ * jobs (&) stay in d until released or closed. */
+int dsh_system(dsh_t *d, const char *cmdline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBDSH_H__ */
@@ -0,0 +1,164 @@
+#include "dsh.h"
+#include <sys/ioctl.h>
+
+/* Metered pipelines. With "meter on", every pipe between two stages of a
+ * job is split in two: the upstream stage writes into one pipe, the
+ * downstream stage reads from another, and dsh splices the data across
+ * from the wait loop. The relay counts the bytes and times two kinds of
+ * stall:
+ *   - blocked: the downstream pipe was full, so the downstream stage is
+ *     too slow and the upstream writer is held back;
+ *   - starved: the relay had nothing to pass on, so the upstream stage is
+ *     too slow and the downstream reader waits.
+ * The edge with the most blocked time sits right before the bottleneck. */
+
+bool dsh_meter = false;
+
+struct meter {
+	struct meter *next;
+	int edge;               /* 1 for the edge after the first stage */
+	char *from, *to;        /* argv[0] of the stages on each side */
+	int in, out;            /* our ends: read from upstream, write downstream; -1 once closed */
+	unsigned long long bytes;
+	int blocked, starved;   /* number of stalls */
+	double blocked_time, starved_time;
+	double start, end, stall_start;
+};
+
+static void meter_readable(int fd, void *arg);
+
+static void meter_close(meter_t *m)
+{
+	if(m->in >= 0) {
+		event_del(m->in);
+		close(m->in);
+		m->in = -1;
+	}
+	if(m->out >= 0) {
+		event_del(m->out);
+		close(m->out);
+		m->out = -1;
+	}
+	if(!m->end)
+		m->end = monotonic_now();
+}
+
+/* downstream pipe has room again: stop watching it and resume the relay */
+static void meter_writable(int fd, void *arg)
+{
+	meter_t *m = (meter_t *)arg;
+
+	event_del(m->out);
+	m->blocked_time += monotonic_now() - m->stall_start;
+	m->stall_start = 0;
+	if(event_add(m->in, meter_readable, m))
+		meter_readable(m->in, m);
+}
+
+static void meter_readable(int fd, void *arg)
+{
+	meter_t *m = (meter_t *)arg;
+	ssize_t n;
+	int pending = 0;
+
+	if(m->stall_start && m->bytes) /* waiting for upstream since the last drain */
+		m->starved_time += monotonic_now() - m->stall_start;
+	m->stall_start = 0;
+
+	while((n = splice(m->in, NULL, m->out, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0)
+		m->bytes += n;
+
+	if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		/* upstream EOF, or downstream went away (EPIPE) */
+		meter_close(m);
+		return;
+	}
+	m->stall_start = monotonic_now();
+	if(ioctl(m->in, FIONREAD, &pending) == 0 && pending > 0) {
+		/* data is waiting but the downstream pipe is full */
+		++m->blocked;
+		event_del(m->in);
+		event_add_writable(m->out, meter_writable, m);
+	} else if(m->bytes) {
+		++m->starved;
+	}
+}
+
+/* Put a relay on the edge after process p of j. upstream is the read end
+ * of the pipe p writes to. Returns the fd the next stage should read
+ * from: upstream itself when metering is off. */
+int meter_edge(job_t *j, process_t *p, int upstream)
+{
+	int fd[2];
+	meter_t *m, **tail;
+	int edge = 1;
+
+	if(!dsh_meter || !p->next)
+		return upstream;
+	if(!(m = (meter_t *)calloc(1, sizeof(meter_t)))) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		return upstream;
+	}
+	if(pipe2(fd, O_CLOEXEC) < 0) {
+		perror("pipe");
+		free(m);
+		return upstream;
+	}
+	fcntl(upstream, F_SETFD, FD_CLOEXEC);
+	fcntl(upstream, F_SETFL, O_NONBLOCK);
+	fcntl(fd[1], F_SETFL, O_NONBLOCK);
+	m->in = upstream;
+	m->out = fd[1];
+	m->from = p->argv[0];
+	m->to = p->next->argv[0];
+	m->start = monotonic_now();
+
+	for(tail = &j->meters; *tail; tail = &(*tail)->next)
+		++edge;
+	m->edge = edge;
+	*tail = m;
+
+	if(!event_add(m->in, meter_readable, m))
+		meter_close(m); /* the next stage just sees EOF */
+	return fd[0];
+}
+
+/* one line per edge: throughput and stalls */
+void meter_print(job_t *j)
+{
+	meter_t *m;
+
+	for(m = j->meters; m; m = m->next) {
+		double elapsed = (m->end ? m->end : monotonic_now()) - m->start;
+		fprintf(stdout, "  edge %d (%s | %s): %llu bytes in %.3fs, %.2f MB/s, "
+			"blocked %d (%.3fs), starved %d (%.3fs)\n",
+			m->edge, m->from, m->to, m->bytes, elapsed,
+			elapsed > 0 ? m->bytes / elapsed / (1024 * 1024) : 0.0,
+			m->blocked, m->blocked_time, m->starved, m->starved_time);
+	}
+}
+
+/* the job is done: stop relaying and report */
+void meter_finish(job_t *j)
+{
+	meter_t *m;
+
+	if(!j->meters)
+		return;
+	for(m = j->meters; m; m = m->next)
+		meter_close(m);
+	fprintf(stdout, "%d(Metered): %s\n", j->pgid, j->commandinfo);
+	meter_print(j);
+}
+
+void meter_free(job_t *j)
+{
+	meter_t *m, *m_next;
+
+	for(m = j->meters; m; m = m_next) {
+		m_next = m->next;
+		meter_close(m);
+		free(m);
+	}
+	j->meters = NULL;
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Benchmark for metered pipelines (meter.c): runs the same workloads with
+# "meter off" and "meter on" and reports what the relay costs.
+#   - stream: BENCH_MB megabytes (default 1000) through a three-stage
+#     pipeline, i.e. two relayed edges; reported as MB/s.
+#   - spawn: BENCH_JOBS short pipelines (default 300) in one script, where
+#     the extra pipes and event registrations per edge dominate; reported
+#     as milliseconds per job.
+# Each figure is the best of BENCH_RUNS runs (default 3).
+#
+#   ./meterbench.sh [dsh binary]    (or: make bench)
+
+DSH=${1:-./dsh}
+MB=${BENCH_MB:-1000}
+JOBS=${BENCH_JOBS:-300}
+RUNS=${BENCH_RUNS:-3}
+
+dir=$(mktemp -d /tmp/dsh-bench.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+now() { date +%s.%N; }
+
+# best wall time in seconds of $RUNS runs of dsh on script $1
+best() {
+	local i t0 t1 best=
+	for ((i = 0; i < RUNS; i++)); do
+		t0=$(now)
+		"$DSH" "$1" > /dev/null 2>&1 || { echo "bench: $1 failed" >&2; exit 1; }
+		t1=$(now)
+		best=$(awk -v t0=$t0 -v t1=$t1 -v b="$best" \
+			'BEGIN { t = t1 - t0; print (b == "" || t < b) ? t : b }')
+	done
+	echo $best
+}
+
+for mode in off on; do
+	echo "meter $mode" > "$dir/stream.$mode"
+	echo "head -c ${MB}000000 /dev/zero | cat | wc -c" >> "$dir/stream.$mode"
+	echo "meter $mode" > "$dir/spawn.$mode"
+	for ((i = 0; i < JOBS; i++)); do
+		echo "echo x | cat | wc -c" >> "$dir/spawn.$mode"
+	done
+done
+
+s_off=$(best "$dir/stream.off")
+s_on=$(best "$dir/stream.on")
+j_off=$(best "$dir/spawn.off")
+j_on=$(best "$dir/spawn.on")
+
+awk -v mb=$MB -v jobs=$JOBS -v s0=$s_off -v s1=$s_on -v j0=$j_off -v j1=$j_on 'BEGIN {
+	printf("stream %dMB:  off %8.1f MB/s   on %8.1f MB/s   overhead %+6.1f%%\n",
+		mb, mb / s0, mb / s1, (s1 / s0 - 1) * 100)
+	printf("spawn %d jobs: off %7.3f ms/job  on %7.3f ms/job  overhead %+6.1f%%\n",
+		jobs, j0 * 1000 / jobs, j1 * 1000 / jobs, (j1 / j0 - 1) * 100)
+}'
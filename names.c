@@ -0,0 +1,316 @@
+#include "dsh.h"
+
+/* Command names dsh resolves itself: builtins, aliases and functions, in
+ * one hash table so that each command costs a single lookup instead of a
+ * strcmp() per builtin.
+ *   - builtins are registered by dsh.c at startup (see builtin_cmd());
+ *   - "alias name=word..." makes name expand to the words, in front of
+ *     the remaining arguments;
+ *   - "function name cmdline" or "function name <<EOF ... EOF" stores the
+ *     body as parsed job_t templates. A call clones the templates and runs
+ *     the clones, so the body is never parsed again; arguments of the call
+ *     are appended to the first command of the last job of the body.
+ * Aliases and functions are usually defined in the rc file, $DSH_RC or
+ * ~/.dshrc, which dsh runs at startup. */
+
+#define NAME_BUCKETS 256
+#define ALIAS_DEPTH 8       /* an alias may expand to another alias */
+#define FUNCTION_DEPTH 32   /* nested (or recursive) function calls */
+
+enum { NAME_BUILTIN, NAME_ALIAS, NAME_FUNCTION };
+
+typedef struct name {
+	struct name *next;
+	char *key;
+	int kind;
+	builtin_fn fn;      /* NAME_BUILTIN */
+	char **words;       /* NAME_ALIAS */
+	int nwords;
+	job_t *body;        /* NAME_FUNCTION: list of job templates */
+} name_t;
+
+static name_t *names[NAME_BUCKETS];
+static int call_depth = 0;
+
+static name_t **bucket(const char *key)
+{
+	return &names[hash_bytes(FNV_OFFSET, key, strlen(key)) % NAME_BUCKETS];
+}
+
+static name_t *lookup(const char *key)
+{
+	name_t *n;
+	for(n = *bucket(key); n; n = n->next)
+		if(!strcmp(n->key, key))
+			return n;
+	return NULL;
+}
+
+/* drop what n currently means, keeping it in the table */
+static void clear(name_t *n)
+{
+	job_t *j, *j_next;
+	int i;
+
+	for(i = 0; i < n->nwords; i++)
+		free(n->words[i]);
+	free(n->words);
+	n->words = NULL;
+	n->nwords = 0;
+	for(j = n->body; j; j = j_next) {
+		j_next = j->next;
+		free_job(j);
+	}
+	n->body = NULL;
+	n->fn = NULL;
+}
+
+/* the entry for key, created if needed; NULL if key is a builtin, which
+ * cannot be redefined */
+static name_t *define(const char *key)
+{
+	name_t *n = lookup(key), **b;
+
+	if(n && n->kind == NAME_BUILTIN) {
+		fprintf(stderr, "%s: is a builtin\n", key);
+		return NULL;
+	}
+	if(n) {
+		clear(n);
+		return n;
+	}
+	if(!(n = (name_t *)calloc(1, sizeof(name_t))) || !(n->key = strdup(key))) {
+		free(n);
+		fprintf(stderr, "%s\n","malloc: no space");
+		return NULL;
+	}
+	b = bucket(key);
+	n->next = *b;
+	*b = n;
+	return n;
+}
+
+static void undefine(const char *key)
+{
+	name_t **link, *n;
+
+	for(link = bucket(key); (n = *link); link = &n->next) {
+		if(!strcmp(n->key, key) && n->kind != NAME_BUILTIN) {
+			*link = n->next;
+			clear(n);
+			free(n->key);
+			free(n);
+			return;
+		}
+	}
+	fprintf(stderr, "%s: not defined\n", key);
+}
+
+void builtin_register(const char *name, builtin_fn fn)
+{
+	name_t *n = define(name);
+	if(!n)
+		return;
+	n->kind = NAME_BUILTIN;
+	n->fn = fn;
+}
+
+builtin_fn builtin_lookup(const char *name)
+{
+	name_t *n = lookup(name);
+	return n && n->kind == NAME_BUILTIN ? n->fn : NULL;
+}
+
+/* the names dsh handles itself rather than by spawning them */
+bool is_builtin(const char *name)
+{
+	return lookup(name) != NULL;
+}
+
+/* Expand aliases at the start of every stage of j. Returns false if an
+ * expansion did not fit into MAX_ARGS. */
+bool alias_expand(job_t *j)
+{
+	process_t *p;
+	name_t *n;
+	int depth, i;
+
+	for(p = j->first_process; p; p = p->next) {
+		for(depth = 0; depth < ALIAS_DEPTH && p->argc > 0; depth++) {
+			if(!(n = lookup(p->argv[0])) || n->kind != NAME_ALIAS)
+				break;
+			if(p->argc - 1 + n->nwords >= MAX_ARGS) {
+				fprintf(stderr, "%s: too many arguments after alias expansion\n", n->key);
+				return false;
+			}
+			free(p->argv[0]);
+			memmove(p->argv + n->nwords, p->argv + 1, p->argc * sizeof(char *)); /* with the NULL */
+			for(i = 0; i < n->nwords; i++)
+				p->argv[i] = strdup(n->words[i]);
+			p->argc += n->nwords - 1;
+		}
+		if(depth == ALIAS_DEPTH) {
+			fprintf(stderr, "%s: alias loop\n", p->argv[0]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* "alias" lists, "alias name=word..." defines, "unalias name" removes */
+void alias_cmd(job_t *j, int argc, char **argv)
+{
+	name_t *n;
+	char *eq;
+	int i;
+
+	if(!strcmp(argv[0], "unalias")) {
+		for(i = 1; i < argc; i++)
+			undefine(argv[i]);
+		return;
+	}
+	if(argc == 1) {
+		for(i = 0; i < NAME_BUCKETS; i++)
+			for(n = names[i]; n; n = n->next) {
+				int k;
+				if(n->kind != NAME_ALIAS)
+					continue;
+				fprintf(stdout, "alias %s=", n->key);
+				for(k = 0; k < n->nwords; k++)
+					fprintf(stdout, k ? " %s" : "%s", n->words[k]);
+				fprintf(stdout, "\n");
+			}
+		return;
+	}
+	if(!(eq = strchr(argv[1], '=')) || eq == argv[1]) {
+		fprintf(stderr, "usage: alias name=word...\n");
+		return;
+	}
+	*eq = '\0';
+	if(!(n = define(argv[1])))
+		return;
+	n->kind = NAME_ALIAS;
+	n->words = (char **)calloc(argc, sizeof(char *));
+	if(eq[1])
+		n->words[n->nwords++] = strdup(eq + 1);
+	for(i = 2; i < argc; i++)
+		n->words[n->nwords++] = strdup(argv[i]);
+	if(!n->nwords)
+		undefine(argv[1]); /* "alias name=" */
+}
+
+/* parse the lines of a here-document into a list of templates */
+static job_t *parse_body(int fd)
+{
+	job_t *first = NULL, *j;
+	FILE *in;
+
+	if((fd = dup(fd)) < 0 || !(in = fdopen(fd, "r"))) {
+		perror("function");
+		return NULL;
+	}
+	while((j = freadcmdline(in, "")) || !feof(in)) {
+		if(!j)
+			continue;
+		if(!first)
+			first = j;
+		else
+			find_last_job(first)->next = j;
+	}
+	fclose(in);
+	return first;
+}
+
+/* "function name cmdline", "function name <<EOF", "unfunction name" or
+ * "function" to list them */
+void function_cmd(job_t *j, int argc, char **argv)
+{
+	process_t *p = j->first_process;
+	name_t *n;
+	job_t *body, *b;
+	int i;
+
+	if(!strcmp(argv[0], "unfunction")) {
+		for(i = 1; i < argc; i++)
+			undefine(argv[i]);
+		return;
+	}
+	if(argc == 1) {
+		for(i = 0; i < NAME_BUCKETS; i++)
+			for(n = names[i]; n; n = n->next)
+				if(n->kind == NAME_FUNCTION)
+					for(b = n->body; b; b = b->next)
+						fprintf(stdout, "%s: %s\n", n->key, b->commandinfo);
+		return;
+	}
+	if(argc == 2 && p->heredoc >= 0) {
+		body = parse_body(p->heredoc);
+	} else if(argc > 2) {
+		/* the rest of this job is the body */
+		if(!(body = clone_job(j)))
+			return;
+		shift_argv(body->first_process, 2);
+		/* and "function name " is not part of its command line */
+		char *cmd = body->commandinfo;
+		for(i = 0; i < 2; i++) {
+			cmd += strspn(cmd, " \t");
+			cmd += strcspn(cmd, " \t");
+		}
+		cmd += strspn(cmd, " \t");
+		memmove(body->commandinfo, cmd, strlen(cmd) + 1);
+		if(body->first_process->heredoc >= 0) {
+			close(body->first_process->heredoc);
+			body->first_process->heredoc = -1;
+		}
+	} else {
+		fprintf(stderr, "usage: function name cmdline, or function name <<EOF\n");
+		return;
+	}
+	if(!body)
+		return;
+	if(!(n = define(argv[1]))) {
+		for(; body; body = b) {
+			b = body->next;
+			free_job(body);
+		}
+		return;
+	}
+	n->kind = NAME_FUNCTION;
+	n->body = body;
+}
+
+/* If argv[0] names a function, run its body with the given arguments
+ * and return true. */
+bool function_call(int argc, char **argv)
+{
+	name_t *n = lookup(argv[0]);
+	job_t *t, *clone, *clones = NULL;
+	process_t *p;
+	int i;
+
+	if(!n || n->kind != NAME_FUNCTION)
+		return false;
+	if(call_depth == FUNCTION_DEPTH) {
+		fprintf(stderr, "%s: functions nested too deeply\n", argv[0]);
+		return true;
+	}
+	/* clone the whole body first, so a redefinition while it runs is safe */
+	for(t = n->body; t; t = t->next) {
+		if(!(clone = clone_job(t)))
+			break;
+		if(!clones)
+			clones = clone;
+		else
+			find_last_job(clones)->next = clone;
+	}
+	if(clones && argc > 1) {
+		p = find_last_job(clones)->first_process;
+		for(i = 1; i < argc && p->argc < MAX_ARGS - 1; i++)
+			p->argv[p->argc++] = strdup(argv[i]);
+		p->argv[p->argc] = NULL;
+	}
+	++call_depth;
+	run_jobs(clones, false);
+	--call_depth;
+	return true;
+}
@@ -0,0 +1,94 @@
+#include "dsh.h"
+
+/* Pipeline optimizer. Runs on every job after parsing and before spawn
+ * and rewrites its process chain where that saves a process and a copy
+ * of the data through a pipe, without changing what the job computes:
+ *   - a stage with a <, << or <<< redirection ignores the pipe in front
+ *     of it (see redirect_io()), so the stages before it are dropped if
+ *     they are all plain cats, which have no effect besides their output;
+ *   - a leading "cat file" or "cat < file" becomes "< file" on the next
+ *     stage, which then reads the file directly.
+ * The user's command line (commandinfo) is left alone. "optimize off"
+ * disables the pass, "optimize verbose" reports every rewrite on stderr. */
+
+int dsh_optimize = OPTIMIZE_ON;
+
+static void report(job_t *j, const char *what)
+{
+	if(dsh_optimize == OPTIMIZE_VERBOSE)
+		fprintf(stderr, "optimize: %s: %s\n", j->commandinfo, what);
+}
+
+/* drop the stages in front of p, which must be in j */
+static void drop_before(job_t *j, process_t *p)
+{
+	process_t *q, *q_next;
+
+	for(q = j->first_process; q != p; q = q_next) {
+		q_next = q->next;
+		free_process(q);
+	}
+	j->first_process = p;
+}
+
+/* a cat that only writes to the pipe, so dropping it changes nothing */
+static bool plain_cat(process_t *p)
+{
+	return p->argc >= 1 && !strcmp(p->argv[0], "cat") && !p->ofile;
+}
+
+/* the file a leading cat copies, or NULL if it is not a plain
+ * single-file cat that can be replaced by a redirection */
+static const char *cat_file(process_t *p)
+{
+	const char *file;
+
+	if(!p->next || p->argc < 1 || strcmp(p->argv[0], "cat") || p->ofile || p->heredoc >= 0)
+		return NULL;
+	if(p->argc == 1)
+		file = p->ifile;
+	else if(p->argc == 2 && !p->ifile && p->argv[1][0] != '-')
+		file = p->argv[1];
+	else
+		return NULL; /* options, several files or stdin */
+	/* keep cat if it would fail, so the job reports it the same way */
+	if(!file || access(file, R_OK) < 0)
+		return NULL;
+	return file;
+}
+
+/* Rewrite j in place; returns true if anything changed. */
+bool optimize_job(job_t *j)
+{
+	process_t *p, *q, *last_input = NULL;
+	const char *file;
+	bool changed = false;
+
+	if(dsh_optimize == OPTIMIZE_OFF || !j->first_process)
+		return false;
+
+	for(p = j->first_process->next; p; p = p->next)
+		if((p->ifile && j->mystdin == INPUT_FD) || p->heredoc >= 0)
+			last_input = p;
+	for(q = j->first_process; last_input && q != last_input; q = q->next)
+		if(!plain_cat(q))
+			last_input = NULL;
+	if(last_input) {
+		drop_before(j, last_input);
+		report(j, "dropped the stages whose output a < redirection overrides");
+		changed = true;
+	}
+
+	if((file = cat_file(j->first_process))) {
+		p = j->first_process->next;
+		if(!(p->ifile = strdup(file))) {
+			fprintf(stderr, "%s\n","malloc: no space");
+			return changed;
+		}
+		j->mystdin = INPUT_FD;
+		drop_before(j, p);
+		report(j, "replaced the leading cat by a < redirection");
+		changed = true;
+	}
+	return changed;
+}
@@ -1,4 +1,5 @@
 #include "dsh.h"
+#include <sys/mman.h>   /* memfd_create() */
 
 int isspace(int c); //check whether the char c is a space
 
@@ -6,8 +7,6 @@ int isspace(int c); //check whether the char c is a space
 bool init_job(job_t *j)
 {
 	j->next = NULL;
-	if(!(j->commandinfo = (char *) calloc(MAX_LEN_CMDLINE,sizeof(char))))
-		return false;
 	j->first_process = NULL;
 	j->pgid = -1; 	                /* -1 indicates spawn new job*/
 	j->notified = false;
@@ -15,6 +14,24 @@ bool init_job(job_t *j)
 	j->mystdout = STDOUT_FILENO;	/* 1 */
 	j->mystderr = STDERR_FILENO;	/* 2 */
 	j->bg = false;
+	j->deadline = 0;
+	j->deadline_fd = -1;
+	j->expired = DEADLINE_NONE;
+	j->capture = NULL;
+	j->meters = NULL;
+	j->cache = NULL;
+	j->start = 0;
+	memset(&j->rusage, 0, sizeof(j->rusage));
+	j->queued = 0;
+	j->prio = 0;
+	j->waited = false;
+	j->seqno = 0;
+	j->spawned = 0;
+	j->schedule = NULL;
+	j->watch = NULL;
+	/* last, so that a failed job can still be handed to free_job() */
+	if(!(j->commandinfo = (char *) calloc(MAX_LEN_CMDLINE,sizeof(char))))
+		return false;
 	return true;
 }
 
@@ -29,6 +46,8 @@ bool init_process(process_t *p)
 	p->next = NULL;
 	p->ifile = NULL;
 	p->ofile = NULL;
+	p->heredoc = -1;
+	p->added = false;
 
 	if(!(p->argv = (char **)calloc(MAX_ARGS,sizeof(char *))))
 		return false;
@@ -68,6 +87,104 @@ bool readprocessinfo(process_t *p, char *cmd)
 	return true;
 }
 
+/*
+ * Parses a here-string (<<< word) or a here-document (<<word, or <<-word
+ * to strip leading tabs) starting at cmdline[*pos] and stores its text in
+ * an anonymous memfd, so no temporary file is written. The body of a
+ * here-document is read from in, up to a line holding only the
+ * delimiter. The memfd is sealed against any change and rewound, then
+ * becomes the stdin of p (see redirect_io()).
+ */
+static bool readheredoc(FILE *in, char *cmdline, int *pos, process_t *p, parse_echo_fn body)
+{
+	char word[MAX_LEN_FILENAME], line[MAX_LEN_CMDLINE];
+	bool string = false, strip_tabs = false;
+	int n = 0, fd;
+
+	*pos += 2;
+	if(cmdline[*pos] == '<') {
+		string = true;
+		++*pos;
+	} else if(cmdline[*pos] == '-') {
+		strip_tabs = true;
+		++*pos;
+	}
+	while(isspace(cmdline[*pos]) && cmdline[*pos] != '\n')
+		++*pos;
+	while(cmdline[*pos] != '\0' && !isspace(cmdline[*pos])) {
+		if(n == MAX_LEN_FILENAME - 1) {
+			fprintf(stderr, "%s\n","here-document: word too long");
+			return false;
+		}
+		if(string || (cmdline[*pos] != '\'' && cmdline[*pos] != '"'))
+			word[n++] = cmdline[*pos]; /* quotes around the delimiter are dropped */
+		++*pos;
+	}
+	word[n] = '\0';
+	while(isspace(cmdline[*pos]) && cmdline[*pos] != '\n')
+		++*pos;
+	if(!n) {
+		fprintf(stderr, "%s\n","here-document: missing word");
+		return false;
+	}
+
+	if((fd = memfd_create("dsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		perror("memfd_create");
+		return false;
+	}
+	if(string) {
+		strcat(word, "\n");
+		if(!write_all(fd, word, strlen(word)))
+			goto fail;
+	} else for(;;) {
+		if(in == stdin && isatty(STDIN_FILENO))
+			fputs("> ", stdout);
+		if(!fgets(line, sizeof(line), in)) {
+			fprintf(stderr, "here-document: end of input before %s\n", word);
+			break;
+		}
+		if(body)
+			body(line);
+		char *text = line;
+		if(strip_tabs)
+			text += strspn(text, "\t");
+		if(!strncmp(text, word, n) && (text[n] == '\n' || text[n] == '\0'))
+			break;
+		if(!write_all(fd, text, strlen(text)))
+			goto fail;
+	}
+	if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+		|| lseek(fd, 0, SEEK_SET) < 0)
+		goto fail;
+
+	/* the last redirection of stdin wins */
+	if(p->heredoc >= 0)
+		close(p->heredoc);
+	free(p->ifile);
+	p->ifile = NULL;
+	p->heredoc = fd;
+	return true;
+fail:
+	perror("here-document");
+	close(fd);
+	return false;
+}
+
+/* Releases everything parse_stream() allocated for a command line that
+ * turned out to be invalid. Always returns NULL, so the error paths can
+ * simply return its result. */
+static job_t* parse_failed(job_t *first_job, char *cmdline, char *cmd)
+{
+	job_t *j, *j_next;
+	for(j = first_job; j; j = j_next) {
+		j_next = j->next;
+		free_job(j);
+	}
+	free(cmd);
+	free(cmdline);
+	return NULL;
+}
+
 /* Basic parser that fills the data structures job_t and process_t defined in
  * dsh.h. We tried to make the parser flexible but it is not tested
  * with arbitrary inputs. Be prepared to hack it for the features
@@ -75,20 +192,24 @@ bool readprocessinfo(process_t *p, char *cmd)
  * and grouping are not supported. If the parser found some error, it
  * will always return NULL.
  *
- * The parser supports these symbols: <, >, |, &, ;
+ * The parser supports these symbols: <, >, |, &, ;, and << / <<< for
+ * here-documents and here-strings
+ *
+ * One command line is read from in, plus the bodies of its here-documents.
+ * line is called with the command line and body with every line of a
+ * here-document body as they are read; either may be NULL.
  */
 
-job_t* readcmdline(char *msg)
+job_t* parse_stream(FILE *in, parse_echo_fn line, parse_echo_fn body)
 {
-
-	fprintf(stdout, "%s", msg);
-
 	char *cmdline = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
 	if(!cmdline) {
 	    	fprintf(stderr, "%s\n","malloc: no space");
         	return NULL;
     	}
-	fgets(cmdline, MAX_LEN_CMDLINE, stdin);
+	fgets(cmdline, MAX_LEN_CMDLINE, in);
+	if(line)
+		line(cmdline);
 
 	/* sequence is true only when the command line contains ; */
 	bool sequence = false;
@@ -107,26 +228,27 @@ job_t* readcmdline(char *msg)
 		bool valid_input = true; /* check for valid input */
 		bool end_of_input = false; /* check for end of input */
 
-		/* cmdline is NOOP, i.e., just return with spaces */
+		/* cmdline is NOOP, i.e., just return with spaces; after a ; this
+		 * ends the sequence */
 		while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0' || feof(stdin))
-			return NULL;
+		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0')
+			break;
 
 		/* Check for invalid special symbols (characters) */
 		if(cmdline[cmdline_pos] == ';' || cmdline[cmdline_pos] == '&'
 			|| cmdline[cmdline_pos] == '<' || cmdline[cmdline_pos] == '>' || cmdline[cmdline_pos] == '|')
-			return NULL;
+			return parse_failed(first_job, cmdline, NULL);
 
 		char *cmd = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
 		if(!cmd) {
 	        	fprintf(stderr, "%s\n","malloc: no space");
-            		return NULL;
+            		return parse_failed(first_job, cmdline, NULL);
         	}
 
 		job_t *newjob = (job_t *)malloc(sizeof(job_t));
 		if(!newjob) {
 	       		fprintf(stderr, "%s\n","malloc: no space");
-            		return NULL;
+            		return parse_failed(first_job, cmdline, cmd);
         	}
 
 		if(!first_job)
@@ -138,20 +260,18 @@ job_t* readcmdline(char *msg)
 
 		if(!init_job(current_job)) {
 	        	fprintf(stderr, "%s\n","malloc: no space");
-			delete_job(current_job,first_job);
-            		return NULL;
+            		return parse_failed(first_job, cmdline, cmd);
         	}
 
         	process_t *newprocess = (process_t *)malloc(sizeof(process_t));
 		if(!newprocess) {
 	        	fprintf(stderr, "%s\n","malloc: no space");
-			delete_job(current_job,first_job);
-            		return NULL;
+            		return parse_failed(first_job, cmdline, cmd);
         	}
 		if(!init_process(newprocess)){
 	        	fprintf(stderr, "%s\n","malloc: no space");
-			delete_job(current_job,first_job);
-            		return NULL;
+			free(newprocess);
+            		return parse_failed(first_job, cmdline, cmd);
         	}
 
 		process_t *current_process = NULL;
@@ -168,11 +288,21 @@ job_t* readcmdline(char *msg)
 			switch (cmdline[cmdline_pos]) {
 
 			    case '<': /* input redirection */
+				if(cmdline[cmdline_pos + 1] == '<') { /* here-document or here-string */
+					if(!readheredoc(in, cmdline, &cmdline_pos, current_process, body))
+						return parse_failed(first_job, cmdline, cmd);
+					valid_input = false;
+					break;
+				}
+				if(current_process->heredoc >= 0) {
+					close(current_process->heredoc);
+					current_process->heredoc = -1;
+				}
+				free(current_process->ifile);
 				current_process->ifile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
 				if(!current_process->ifile) {
 					fprintf(stderr, "%s\n","malloc: no space");
-					delete_job(current_job,first_job);
-					return NULL;
+					return parse_failed(first_job, cmdline, cmd);
                 		}
 				++cmdline_pos;
 				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
@@ -180,8 +310,7 @@ job_t* readcmdline(char *msg)
 				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
 					if(MAX_LEN_FILENAME == iofile_seek) {
 	                    			fprintf(stderr, "%s\n","malloc: no space");
-			            		delete_job(current_job,first_job);
-                        			return NULL;
+                        			return parse_failed(first_job, cmdline, cmd);
                     			}
 					current_process->ifile[iofile_seek++] = cmdline[cmdline_pos++];
 				}
@@ -196,11 +325,11 @@ job_t* readcmdline(char *msg)
 				break;
 
 			    case '>': /* output redirection */
+				free(current_process->ofile); /* "cmd > a > b": the last one wins */
 				current_process->ofile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
 				if(!current_process->ofile) {
 	                		fprintf(stderr, "%s\n","malloc: no space");
-			        	delete_job(current_job,first_job);
-                    			return NULL;
+                    			return parse_failed(first_job, cmdline, cmd);
                 		}
 				++cmdline_pos;
 				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
@@ -208,8 +337,7 @@ job_t* readcmdline(char *msg)
 				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
 					if(MAX_LEN_FILENAME == iofile_seek) {
 	                    			fprintf(stderr, "%s\n","malloc: no space");
-			            		delete_job(current_job,first_job);
-                        			return NULL;
+                        			return parse_failed(first_job, cmdline, cmd);
                     			}
 					current_process->ofile[iofile_seek++] = cmdline[cmdline_pos++];
 				}
@@ -228,20 +356,19 @@ job_t* readcmdline(char *msg)
 				process_t *newprocess = (process_t *)malloc(sizeof(process_t));
 				if(!newprocess) {
 	                		fprintf(stderr, "%s\n","malloc: no space");
-			        	delete_job(current_job,first_job);
-                    			return NULL;
+                    			return parse_failed(first_job, cmdline, cmd);
                 		}
 				if(!init_process(newprocess)) {
 					fprintf(stderr, "%s\n","init_process: failed");
-					delete_job(current_job,first_job);
-				    	return NULL;
+					free(newprocess);
+				    	return parse_failed(first_job, cmdline, cmd);
                 		}
+				/* link first so that an error below frees newprocess too */
+				current_process->next = newprocess;
 				if(!readprocessinfo(current_process, cmd)) {
 					fprintf(stderr, "%s\n","parse cmd: error");
-					delete_job(current_job,first_job);
-			    		return NULL;
+			    		return parse_failed(first_job, cmdline, cmd);
 				}
-				current_process->next = newprocess;
 				current_process = current_process->next;
 				++cmdline_pos;
 				cmd_pos = 0; /*Reinitialze for new cmd */
@@ -269,13 +396,11 @@ job_t* readcmdline(char *msg)
 			   default:
 				if(!valid_input) {
 					fprintf(stderr, "%s\n", "reading cmdline: could not fathom input");
-			        	delete_job(current_job,first_job);
-                    			return NULL;
+                    			return parse_failed(first_job, cmdline, cmd);
                 		}
 				if(cmd_pos == MAX_LEN_CMDLINE-1) {
 					fprintf(stderr,"%s\n","reading cmdline: length exceeds the max limit");
-			        	delete_job(current_job,first_job);
-                    			return NULL;
+                    			return parse_failed(first_job, cmdline, cmd);
                 		}
 				cmd[cmd_pos++] = cmdline[cmdline_pos++];
 				break;
@@ -287,9 +412,7 @@ job_t* readcmdline(char *msg)
 
 		if(!readprocessinfo(current_process, cmd)) {
 			fprintf(stderr,"%s\n","read process info: error");
-			delete_job(current_job,first_job);
-			free(cmd);
-            		return NULL;
+            		return parse_failed(first_job, cmdline, cmd);
         	}
 		free(cmd);
 		if(!sequence) {
@@ -298,7 +421,6 @@ job_t* readcmdline(char *msg)
 		}
 		sequence = false;
 		++cmdline_pos;
-		free(cmd);
 	}
 	free(cmdline);	
 	return first_job;
@@ -0,0 +1,353 @@
+#include "dsh.h"
+#include <elf.h>
+#include <sys/mman.h>
+
+/* Predictive exec prefetch ("prefetch on"). dsh counts which command
+ * follows which, keyed by argv[0] of the first stage, and keeps the
+ * counts in <cache dir>/prefetch across sessions. Whenever a job is
+ * spawned, the PREFETCH_FANOUT commands most likely to come next are
+ * resolved through PATH once dsh is back at the prompt, and their
+ * executables and the shared libraries they list as DT_NEEDED get
+ * posix_fadvise(WILLNEED), so the kernel reads them in while the user
+ * types. Only files that are not fully in the page cache are advised,
+ * up to PREFETCH_BUDGET bytes per prediction.
+ *
+ * "prefetch" prints the hit rate and how much cold data was warmed ahead
+ * of commands that were then actually run, which is the I/O taken off
+ * their start-up path. */
+
+#define CMD_BUCKETS 256
+
+typedef struct succ {
+	struct succ *next;
+	char *name;
+	unsigned count;
+} succ_t;
+
+typedef struct cmd {
+	struct cmd *next;
+	char *name;
+	succ_t *succ;
+} cmd_t;
+
+bool dsh_prefetch = false;
+
+static cmd_t *cmds[CMD_BUCKETS];
+static char *last_cmd = NULL;
+static bool loaded = false, dirty = false;
+
+/* what the last prediction warmed, to score it against the next command */
+static char *predicted[PREFETCH_FANOUT];
+static off_t predicted_cold[PREFETCH_FANOUT];
+static bool unwarmed = false; /* prefetch_warm() has not run for them yet */
+
+static unsigned long predictions = 0, hits = 0;
+static unsigned long long advised = 0, warmed_hits = 0;
+
+static cmd_t *cmd_lookup(const char *name, bool create)
+{
+	cmd_t **b = &cmds[hash_bytes(FNV_OFFSET, name, strlen(name)) % CMD_BUCKETS], *c;
+
+	for(c = *b; c; c = c->next)
+		if(!strcmp(c->name, name))
+			return c;
+	if(!create || !(c = (cmd_t *)calloc(1, sizeof(cmd_t))))
+		return NULL;
+	c->name = strdup(name);
+	c->next = *b;
+	*b = c;
+	return c;
+}
+
+static void count(const char *prev, const char *next, unsigned n)
+{
+	cmd_t *c = cmd_lookup(prev, true);
+	succ_t *s;
+
+	if(!c)
+		return;
+	for(s = c->succ; s; s = s->next)
+		if(!strcmp(s->name, next)) {
+			s->count += n;
+			return;
+		}
+	if(!(s = (succ_t *)calloc(1, sizeof(succ_t))))
+		return;
+	s->name = strdup(next);
+	s->count = n;
+	s->next = c->succ;
+	c->succ = s;
+}
+
+static const char *db_path()
+{
+	static char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/prefetch", dsh_cache_dir());
+	return path;
+}
+
+static void save()
+{
+	char tmp[PATH_MAX + 16];
+	FILE *f;
+	cmd_t *c;
+	succ_t *s;
+	int i;
+
+	if(!dirty)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", db_path(), getpid());
+	if(!(f = fopen(tmp, "w")))
+		return;
+	for(i = 0; i < CMD_BUCKETS; i++)
+		for(c = cmds[i]; c; c = c->next)
+			for(s = c->succ; s; s = s->next)
+				fprintf(f, "%s %s %u\n", c->name, s->name, s->count);
+	if(fclose(f) == 0)
+		rename(tmp, db_path());
+	else
+		unlink(tmp);
+}
+
+static void load()
+{
+	char prev[MAX_LEN_CMDLINE], next[MAX_LEN_CMDLINE];
+	unsigned n;
+	FILE *f;
+
+	if(loaded)
+		return;
+	loaded = true;
+	if((f = fopen(db_path(), "r"))) {
+		while(fscanf(f, "%119s %119s %u", prev, next, &n) == 3)
+			count(prev, next, n);
+		fclose(f);
+	}
+	atexit(save);
+}
+
+/* bytes of fd's first len bytes that are not in the page cache */
+static off_t cold_bytes(int fd, off_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t pages = (len + page - 1) / page, i;
+	unsigned char *vec;
+	void *map;
+	off_t cold = 0;
+
+	if(len == 0)
+		return 0;
+	if((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return len;
+	if((vec = (unsigned char *)malloc(pages)) && mincore(map, len, vec) == 0) {
+		for(i = 0; i < pages; i++)
+			if(!(vec[i] & 1))
+				cold += page;
+	} else {
+		cold = len;
+	}
+	free(vec);
+	munmap(map, len);
+	return cold;
+}
+
+/* advise one file; returns the cold bytes it had, charged to *budget */
+static off_t warm(const char *path, off_t *budget)
+{
+	struct stat st;
+	off_t cold = 0, len;
+	int fd;
+
+	if(*budget <= 0 || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		len = st.st_size < *budget ? st.st_size : *budget;
+		if((cold = cold_bytes(fd, len)) > 0) {
+			posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+			*budget -= len;
+			advised += len;
+		}
+	}
+	close(fd);
+	return cold;
+}
+
+static bool read_at(int fd, void *buf, size_t n, off_t off)
+{
+	return pread(fd, buf, n, off) == (ssize_t)n;
+}
+
+/* where the dynamic loader would find the library name */
+static bool find_library(const char *name, char *path, size_t len)
+{
+	static const char *dirs[] = {
+		"/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu", "/lib64", "/usr/lib64",
+		"/lib", "/usr/lib", "/usr/local/lib", NULL
+	};
+	const char *env = getenv("LD_LIBRARY_PATH");
+	int i;
+
+	while(env && *env) {
+		size_t n = strcspn(env, ":");
+		snprintf(path, len, "%.*s/%s", (int)n, env, name);
+		if(access(path, R_OK) == 0)
+			return true;
+		env += n + (env[n] == ':');
+	}
+	for(i = 0; dirs[i]; i++) {
+		snprintf(path, len, "%s/%s", dirs[i], name);
+		if(access(path, R_OK) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* warm the DT_NEEDED libraries of the 64-bit ELF executable at exe */
+static off_t warm_libraries(const char *exe, off_t *budget)
+{
+	Elf64_Ehdr eh;
+	Elf64_Phdr ph, loads[16];
+	Elf64_Dyn dyn;
+	Elf64_Addr strtab = 0;
+	Elf64_Xword needed[PREFETCH_LIBS];
+	off_t dyn_off = 0, cold = 0;
+	size_t dyn_size = 0, i;
+	int fd, nloads = 0, nneeded = 0, k;
+
+	if((fd = open(exe, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if(!read_at(fd, &eh, sizeof(eh), 0) || memcmp(eh.e_ident, ELFMAG, SELFMAG)
+		|| eh.e_ident[EI_CLASS] != ELFCLASS64)
+		goto out; /* scripts, 32-bit binaries: just the file itself */
+	for(i = 0; i < eh.e_phnum; i++) {
+		if(!read_at(fd, &ph, sizeof(ph), eh.e_phoff + i * eh.e_phentsize))
+			goto out;
+		if(ph.p_type == PT_DYNAMIC) {
+			dyn_off = ph.p_offset;
+			dyn_size = ph.p_filesz;
+		} else if(ph.p_type == PT_LOAD && nloads < 16) {
+			loads[nloads++] = ph;
+		}
+	}
+	for(i = 0; i + sizeof(dyn) <= dyn_size; i += sizeof(dyn)) {
+		if(!read_at(fd, &dyn, sizeof(dyn), dyn_off + i) || dyn.d_tag == DT_NULL)
+			break;
+		if(dyn.d_tag == DT_STRTAB)
+			strtab = dyn.d_un.d_ptr;
+		else if(dyn.d_tag == DT_NEEDED && nneeded < PREFETCH_LIBS)
+			needed[nneeded++] = dyn.d_un.d_val;
+	}
+	/* the string table is given as an address; map it to a file offset */
+	for(k = 0; k < nloads; k++)
+		if(strtab >= loads[k].p_vaddr && strtab < loads[k].p_vaddr + loads[k].p_filesz)
+			break;
+	if(k == nloads)
+		goto out;
+	for(i = 0; i < (size_t)nneeded; i++) {
+		char name[256], path[PATH_MAX];
+		off_t off = strtab - loads[k].p_vaddr + loads[k].p_offset + needed[i];
+		ssize_t n = pread(fd, name, sizeof(name) - 1, off);
+		if(n <= 0)
+			continue;
+		name[n] = '\0';
+		if(!strchr(name, '/') && find_library(name, path, sizeof(path)))
+			cold += warm(path, budget);
+	}
+out:
+	close(fd);
+	return cold;
+}
+
+/* successors of c, most frequent first, into best[] */
+static int top_successors(cmd_t *c, succ_t **best)
+{
+	succ_t *s;
+	int n = 0, i;
+
+	for(s = c->succ; s; s = s->next) {
+		for(i = n; i > 0 && best[i - 1]->count < s->count; i--)
+			if(i < PREFETCH_FANOUT)
+				best[i] = best[i - 1];
+		if(i < PREFETCH_FANOUT) {
+			best[i] = s;
+			if(n < PREFETCH_FANOUT)
+				++n;
+		}
+	}
+	return n;
+}
+
+/* The job j is about to be spawned: learn from it, score the last
+ * prediction and predict the commands likely to follow it. This only
+ * touches memory; prefetch_warm() does the I/O later. */
+void prefetch_job(job_t *j)
+{
+	const char *name = j->first_process->argv[0];
+	succ_t *best[PREFETCH_FANOUT];
+	cmd_t *c;
+	int i, n;
+
+	if(!dsh_prefetch)
+		return;
+	load();
+
+	for(i = 0; i < PREFETCH_FANOUT && predicted[i]; i++)
+		if(!strcmp(predicted[i], name)) {
+			++hits;
+			warmed_hits += predicted_cold[i];
+			break;
+		}
+	if(last_cmd) {
+		count(last_cmd, name, 1);
+		dirty = true;
+		free(last_cmd);
+	}
+	last_cmd = strdup(name);
+
+	for(i = 0; i < PREFETCH_FANOUT; i++) {
+		free(predicted[i]);
+		predicted[i] = NULL;
+	}
+	if(!(c = cmd_lookup(name, false)) || !(n = top_successors(c, best)))
+		return;
+	++predictions;
+	for(i = 0; i < n; i++) {
+		predicted[i] = strdup(best[i]->name);
+		predicted_cold[i] = 0;
+	}
+	unwarmed = true;
+}
+
+/* Warms the files of the last prediction. Called from the wait loop at
+ * the prompt, so the reads overlap with the user typing and never delay
+ * a job's start. */
+void prefetch_warm()
+{
+	off_t budget = PREFETCH_BUDGET;
+	char path[PATH_MAX];
+	int i;
+
+	if(!unwarmed)
+		return;
+	unwarmed = false;
+	for(i = 0; i < PREFETCH_FANOUT && predicted[i]; i++)
+		if(find_in_path(predicted[i], path, sizeof(path)))
+			predicted_cold[i] = warm(path, &budget) + warm_libraries(path, &budget);
+}
+
+/* "prefetch [on|off]" */
+void prefetch_cmd(int argc, char **argv)
+{
+	if(argc == 2 && !strcmp(argv[1], "on")) {
+		dsh_prefetch = true;
+		load();
+	} else if(argc == 2 && !strcmp(argv[1], "off")) {
+		dsh_prefetch = false;
+	} else {
+		fprintf(stdout, "prefetch is %s: %lu predictions, %lu hits (%.0f%%), "
+			"%.1f MB advised, %.1f MB of cold data warmed ahead of hits\n",
+			dsh_prefetch ? "on" : "off", predictions, hits,
+			predictions ? 100.0 * hits / predictions : 0.0,
+			advised / 1048576.0, warmed_hits / 1048576.0);
+	}
+}
@@ -0,0 +1,131 @@
+#include "dsh.h"
+
+/* Background job queue. At most dsh_queue_limit background jobs run at
+ * once (0: one per CPU); any further "&" job waits here with a ticket
+ * number and is shown by "jobs" as q<ticket>. Whenever the reaper sees a
+ * job finish or stop, the queued job with the highest priority (the
+ * lowest ticket among equals) is spawned. "prio", "bg" and "fg" can
+ * promote a queued job; "queue" shows and sets the limit.
+ *
+ * With "queue load" the CPU count is reduced by the load average that is
+ * not our own, so several shells (or other work) on one host do not
+ * oversubscribe it together. */
+
+int dsh_queue_limit = 0;        /* background jobs; 0 for the number of CPUs */
+bool dsh_queue_load = false;    /* scale the limit by the load average */
+
+static int next_ticket = 1;
+
+static int queue_limit(int running)
+{
+	long ncpu;
+	double load;
+
+	if(dsh_queue_limit > 0)
+		return dsh_queue_limit;
+	if((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	if(dsh_queue_load && getloadavg(&load, 1) == 1) {
+		/* our running jobs are part of the load already */
+		double others = load - running;
+		if(others > 0)
+			ncpu -= (long)(others + 0.5);
+	}
+	return ncpu < 1 ? 1 : ncpu;
+}
+
+/* background jobs that are spawned and neither done nor stopped */
+static int running_jobs(job_t *first_job)
+{
+	job_t *j;
+	int n = 0;
+
+	for(j = first_job; j; j = j->next)
+		if(j->bg && !j->queued && j->pgid != -1 && !job_is_stopped(j))
+			++n;
+	return n;
+}
+
+/* the next queued job to admit */
+static job_t *queue_head(job_t *first_job)
+{
+	job_t *j, *best = NULL;
+
+	for(j = first_job; j; j = j->next)
+		if(j->queued && (!best || j->prio > best->prio
+			|| (j->prio == best->prio && j->queued < best->queued)))
+			best = j;
+	return best;
+}
+
+/* true while any job waits in the queue */
+bool queue_pending(job_t *first_job)
+{
+	return queue_head(first_job) != NULL;
+}
+
+/* Queue the background job j if the limit is reached or other jobs are
+ * already waiting (so that jobs start in order). Returns true if j was
+ * queued; it then stays on the job list unspawned. */
+bool queue_job(job_t *j, job_t *first_job)
+{
+	if(!j->bg)
+		return false;
+	if(!queue_head(first_job) && running_jobs(first_job) < queue_limit(running_jobs(first_job)))
+		return false;
+	j->queued = next_ticket++;
+	if(!dsh_quiet)
+		fprintf(stdout, "q%d(Queued): %s\n", j->queued, j->commandinfo);
+	return true;
+}
+
+/* take j off the queue and spawn it; fg as for spawn_job() */
+void queue_start(job_t *j, bool fg)
+{
+	j->queued = 0;
+	spawn_job(j, fg);
+}
+
+/* Spawn queued jobs while there is room. Called by the reaper and after
+ * the limit or a priority changed. */
+void queue_admit(job_t *first_job)
+{
+	job_t *j;
+	int running = running_jobs(first_job);
+
+	while(running < queue_limit(running) && (j = queue_head(first_job))) {
+		queue_start(j, false);
+		++running;
+	}
+}
+
+/* "queue [<n>|auto|load]" */
+void queue_cmd(job_t *first_job, int argc, char **argv)
+{
+	job_t *j;
+	int queued = 0, running = running_jobs(first_job);
+
+	if(argc == 2) {
+		if(!strcmp(argv[1], "auto")) {
+			dsh_queue_limit = 0;
+			dsh_queue_load = false;
+		} else if(!strcmp(argv[1], "load")) {
+			dsh_queue_limit = 0;
+			dsh_queue_load = true;
+		} else if(atoi(argv[1]) > 0) {
+			dsh_queue_limit = atoi(argv[1]);
+		} else {
+			fprintf(stderr, "usage: queue [<n>|auto|load]\n");
+			return;
+		}
+		queue_admit(first_job);
+		return;
+	}
+	for(j = first_job; j; j = j->next)
+		if(j->queued)
+			++queued;
+	fprintf(stdout, "queue: %d running, %d queued, limit %d (%s)\n",
+		running, queued, queue_limit(running),
+		dsh_queue_limit ? "fixed" : dsh_queue_load ? "CPUs less load" : "CPUs");
+}
+
@@ -0,0 +1,361 @@
+#include "dsh.h"
+#include <sys/timerfd.h>
+
+/* Periodic jobs: "every [-o skip|queue|allow] <interval> cmdline" parses
+ * cmdline once and launches a copy of it as a background job every
+ * interval (500ms, 10 or 10s, 5m, 1h). Runs are due at fixed multiples
+ * of the interval from the time the entry was made, so they do not drift
+ * however long each launch takes.
+ *
+ * All entries sit in one min-heap ordered by their next due time, and a
+ * single timerfd in the wait loop is armed for the top of the heap, so
+ * thousands of entries cost one fd and O(log n) per launch.
+ *
+ * -o decides what happens when a run is due while the previous one still
+ * runs: skip it (the default), queue it until the previous one finishes
+ * (one run at most; any further one is skipped), or allow both at once.
+ * Skipped runs, and runs lost because dsh itself was a whole interval
+ * late, are counted as missed; "every" lists the entries with these
+ * counts and how late the runs started, and "every cancel <id|all>"
+ * removes entries. */
+
+struct schedule {
+	int id;
+	double interval;        /* seconds */
+	double due;             /* monotonic_now() of the next run */
+	int overlap;            /* SCHEDULE_SKIP, SCHEDULE_QUEUE or SCHEDULE_ALLOW */
+	job_t *template;        /* as parsed; every run is a clone_job() of it */
+	int slot;               /* index in the heap; -1 once cancelled */
+	int running;            /* runs spawned and not completed */
+	int pending;            /* 1 if a run waits for the running one (queue) */
+	int refs;               /* jobs on the job list that point here */
+	unsigned long runs, skipped, dropped, delayed;
+	double late_max, late_sum;
+};
+
+static schedule_t **heap = NULL;
+static int nheap = 0, heap_size = 0;
+static int timer_fd = -1;
+static int next_id = 1;
+
+static const char *overlap_names[] = { "skip", "queue", "allow" };
+
+static void heap_set(int i, schedule_t *s)
+{
+	heap[i] = s;
+	s->slot = i;
+}
+
+static void sift_up(int i)
+{
+	schedule_t *s = heap[i];
+	while(i > 0 && heap[(i - 1) / 2]->due > s->due) {
+		heap_set(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(i, s);
+}
+
+static void sift_down(int i)
+{
+	schedule_t *s = heap[i];
+	int child;
+	while((child = 2 * i + 1) < nheap) {
+		if(child + 1 < nheap && heap[child + 1]->due < heap[child]->due)
+			++child;
+		if(heap[child]->due >= s->due)
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, s);
+}
+
+static bool heap_push(schedule_t *s)
+{
+	if(nheap == heap_size) {
+		int n = heap_size ? 2 * heap_size : 16;
+		schedule_t **grown = (schedule_t **)realloc(heap, n * sizeof(schedule_t *));
+		if(!grown) {
+			fprintf(stderr, "%s\n","malloc: no space");
+			return false;
+		}
+		heap = grown;
+		heap_size = n;
+	}
+	heap_set(nheap++, s);
+	sift_up(nheap - 1);
+	return true;
+}
+
+static void heap_remove(schedule_t *s)
+{
+	schedule_t *last;
+	int i = s->slot;
+
+	s->slot = -1;
+	if(--nheap == i)
+		return;
+	last = heap[nheap];
+	heap_set(i, last);
+	sift_down(i);
+	sift_up(last->slot);
+}
+
+static void release(schedule_t *s)
+{
+	if(s->slot >= 0 || s->refs > 0)
+		return; /* still scheduled, or runs still point here */
+	free_job(s->template);
+	free(s);
+}
+
+/* arm the timer for the earliest entry, or disarm it */
+static void arm()
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if(nheap > 0) {
+		/* a due time of 0 would disarm the timer */
+		double due = heap[0]->due > 1e-9 ? heap[0]->due : 1e-9;
+		its.it_value.tv_sec = (time_t)due;
+		its.it_value.tv_nsec = (long)((due - (time_t)due) * 1e9);
+	}
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void launch(schedule_t *s)
+{
+	bool quiet = dsh_quiet;
+	job_t *j;
+
+	if(!(j = clone_job(s->template)))
+		return;
+	j->bg = true;
+	j->schedule = s;
+	++s->refs;
+	++s->running;
+	++s->runs;
+	optimize_job(j);
+	zstream_job(j);
+	/* may land behind the jobs of a line that is still running; the
+	 * line's run_jobs() stops at its own last job and never spawns it */
+	append_jobs(j);
+	dsh_quiet = true; /* no launch message every period */
+	spawn_job(j, false);
+	dsh_quiet = quiet;
+}
+
+/* wait loop callback: launch every entry that is due */
+static void schedule_fire(int fd, void *arg)
+{
+	uint64_t expirations;
+	double now = monotonic_now(), late;
+	schedule_t *s;
+	unsigned long lost;
+
+	if(read(fd, &expirations, sizeof(expirations)) < 0) { /* spurious wakeup */ }
+	while(nheap > 0 && (s = heap[0])->due <= now) {
+		late = now - s->due;
+		if(late > s->late_max)
+			s->late_max = late;
+		s->late_sum += late;
+		if(!s->running || s->overlap == SCHEDULE_ALLOW)
+			launch(s);
+		else if(s->overlap == SCHEDULE_QUEUE && !s->pending)
+			++s->pending;
+		else
+			++s->skipped;
+		/* keep to the original grid; periods already gone are lost */
+		s->due += s->interval;
+		if(s->due <= now) {
+			lost = (unsigned long)((now - s->due) / s->interval) + 1;
+			s->dropped += lost;
+			s->due += lost * s->interval;
+		}
+		sift_down(0);
+	}
+	arm();
+}
+
+/* A run of s completed (called from the reaper): start a queued one */
+void schedule_done(job_t *j)
+{
+	schedule_t *s = j->schedule;
+
+	--s->running;
+	if(s->pending > 0 && s->slot >= 0) {
+		--s->pending;
+		++s->delayed;
+		launch(s);
+	}
+}
+
+/* j is being freed */
+void schedule_free(job_t *j)
+{
+	schedule_t *s = j->schedule;
+
+	if(!s)
+		return;
+	j->schedule = NULL;
+	--s->refs;
+	release(s);
+}
+
+/* true while any entry is scheduled */
+bool schedule_pending()
+{
+	return nheap > 0;
+}
+
+/* "500ms", "10", "10s", "5m", "1h" in seconds; 0 if invalid */
+static double parse_interval(const char *arg)
+{
+	char *end;
+	double v = strtod(arg, &end);
+
+	if(end == arg || v <= 0)
+		return 0;
+	if(!strcmp(end, "ms"))
+		return v / 1000;
+	if(!*end || !strcmp(end, "s"))
+		return v;
+	if(!strcmp(end, "m"))
+		return v * 60;
+	if(!strcmp(end, "h"))
+		return v * 3600;
+	return 0;
+}
+
+static int by_id(const void *a, const void *b)
+{
+	return (*(schedule_t **)a)->id - (*(schedule_t **)b)->id;
+}
+
+static void list()
+{
+	schedule_t **sorted;
+	int i;
+
+	if(!nheap || !(sorted = (schedule_t **)malloc(nheap * sizeof(schedule_t *))))
+		return;
+	memcpy(sorted, heap, nheap * sizeof(schedule_t *));
+	qsort(sorted, nheap, sizeof(schedule_t *), by_id);
+	for(i = 0; i < nheap; i++) {
+		schedule_t *s = sorted[i];
+		/* every time the entry came due: a queued run that started later
+		 * is in runs already */
+		unsigned long due = s->runs + s->skipped + s->pending;
+		fprintf(stdout, "#%d every %gs (%s): %s\n", s->id, s->interval,
+			overlap_names[s->overlap], s->template->commandinfo);
+		fprintf(stdout, "  %lu runs, %d running, %d queued; %lu missed (%lu overlapping, "
+			"%lu while dsh was late); start late by %.1fms max, %.1fms avg\n",
+			s->runs, s->running, s->pending, s->skipped + s->dropped, s->skipped,
+			s->dropped, s->late_max * 1000, due ? s->late_sum * 1000 / due : 0.0);
+	}
+	free(sorted);
+}
+
+static void cancel(const char *arg)
+{
+	int i, id = atoi(arg);
+	bool all = !strcmp(arg, "all");
+
+	for(i = nheap - 1; i >= 0; i--) {
+		schedule_t *s = heap[i];
+		if(all || s->id == id) {
+			heap_remove(s);
+			s->pending = 0;
+			release(s);
+			if(!all) {
+				arm();
+				return;
+			}
+		}
+	}
+	if(!all) {
+		fprintf(stderr, "every: no entry %s\n", arg);
+		return;
+	}
+	arm();
+}
+
+/* "every [-o skip|queue|allow] <interval> cmdline", "every" to list and
+ * "every cancel <id|all>" */
+void every_cmd(job_t *j, int argc, char **argv)
+{
+	process_t *p = j->first_process;
+	int overlap = SCHEDULE_SKIP, skip = 1;
+	double interval;
+	schedule_t *s;
+	job_t *t;
+
+	if(argc == 1) {
+		list();
+		return;
+	}
+	if(argc == 3 && !strcmp(argv[1], "cancel")) {
+		cancel(argv[2]);
+		return;
+	}
+	if(argc > 2 && !strcmp(argv[1], "-o")) {
+		for(overlap = SCHEDULE_SKIP; overlap <= SCHEDULE_ALLOW; overlap++)
+			if(!strcmp(argv[2], overlap_names[overlap]))
+				break;
+		if(overlap > SCHEDULE_ALLOW) {
+			fprintf(stderr, "every: -o takes skip, queue or allow\n");
+			return;
+		}
+		skip = 3;
+	}
+	if(argc < skip + 2 || !(interval = parse_interval(argv[skip]))) {
+		fprintf(stderr, "usage: every [-o skip|queue|allow] <interval> cmdline\n");
+		return;
+	}
+
+	shift_argv(p, skip + 1);
+	drop_words(j->commandinfo, skip + 1);
+	if(!(t = clone_job(j)))
+		return;
+	if(!alias_expand(t) || deadline_prefix(t)) {
+		free_job(t);
+		return;
+	}
+	if(is_builtin(t->first_process->argv[0]) || !strcmp(t->first_process->argv[0], "cache")) {
+		fprintf(stderr, "every: %s: only external commands can be scheduled\n", t->first_process->argv[0]);
+		free_job(t);
+		return;
+	}
+	if(timer_fd < 0) {
+		if((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+			perror("timerfd_create");
+			free_job(t);
+			return;
+		}
+		if(!event_add(timer_fd, schedule_fire, NULL)) {
+			close(timer_fd);
+			timer_fd = -1;
+			free_job(t);
+			return;
+		}
+	}
+	if(!(s = (schedule_t *)calloc(1, sizeof(schedule_t)))) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		free_job(t);
+		return;
+	}
+	s->id = next_id++;
+	s->interval = interval;
+	s->due = monotonic_now() + interval;
+	s->overlap = overlap;
+	s->template = t;
+	if(!heap_push(s)) {
+		free_job(t);
+		free(s);
+		return;
+	}
+	arm();
+	if(!dsh_quiet)
+		fprintf(stdout, "#%d every %gs: %s\n", s->id, interval, t->commandinfo);
+}
@@ -0,0 +1,270 @@
+#include "dsh.h"
+
+/* Session record and replay, for catching latency regressions between dsh
+ * builds. "dsh -r log" runs an interactive session and writes to log:
+ *   L <ms since the previous line> <input line>
+ *   C <here-document line belonging to the input line before>
+ *   J <job number> <exit status> <ms from spawn to completion> <cmdline>
+ * Lines starting with # are comments. Jobs are numbered in the order the
+ * shell runs them, builtins included, so the numbers match between a
+ * recording and its replay.
+ *
+ * "dsh -p log" feeds the recorded lines back with the recorded gaps
+ * ("dsh -P log" as fast as possible), waits for every job, then compares
+ * exit status and run time of each job against the recording. A job is
+ * reported slower when it took more than DSH_REPLAY_TOLERANCE percent
+ * (default 20) and more than SESSION_SLACK_MS longer. The exit status is
+ * 1 if anything differs, so a replay can gate a new build. */
+
+#define SESSION_SLACK_MS 10
+
+typedef struct outcome {
+	int status;
+	long ms;
+	char *cmd;
+	bool seen;              /* replay: the job completed */
+	int new_status;
+	long new_ms;
+} outcome_t;
+
+static FILE *record = NULL;
+static double last_line = 0;    /* monotonic time of the previous line */
+static int njobs = 0;           /* jobs run so far */
+
+static outcome_t *outcomes = NULL; /* replay: indexed by job number */
+static int noutcomes = 0;
+static bool replaying = false;
+
+static void strip_newline(char *s)
+{
+	s[strcspn(s, "\n")] = '\0';
+}
+
+/* start recording to path; false if it cannot be opened */
+bool session_record(const char *path)
+{
+	if(!(record = fopen(path, "w"))) {
+		perror(path);
+		return false;
+	}
+	fcntl(fileno(record), F_SETFD, FD_CLOEXEC);
+	last_line = monotonic_now();
+	fprintf(record, "# dsh session %d\n", getpid());
+	fflush(record);
+	return true;
+}
+
+/* an input line was read from the terminal */
+void session_line(const char *cmdline)
+{
+	double now = monotonic_now();
+	char line[MAX_LEN_CMDLINE];
+
+	if(!record || !cmdline[0])
+		return;
+	snprintf(line, sizeof(line), "%s", cmdline);
+	strip_newline(line);
+	fprintf(record, "L %ld %s\n", (long)((now - last_line) * 1000), line);
+	fflush(record);
+	last_line = now;
+}
+
+/* a here-document line read from the terminal */
+void session_body(const char *line)
+{
+	if(!record)
+		return;
+	fprintf(record, "C %.*s\n", (int)strcspn(line, "\n"), line);
+	fflush(record);
+}
+
+/* j is about to be run: give it its number */
+void session_run(job_t *j)
+{
+	j->seqno = ++njobs;
+}
+
+/* j completed: log or check its outcome */
+void session_job_done(job_t *j)
+{
+	long ms = (long)((monotonic_now() - j->spawned) * 1000);
+
+	if(record) {
+		fprintf(record, "J %d %d %ld %s\n", j->seqno, job_status(j), ms, j->commandinfo);
+		fflush(record);
+	}
+	if(replaying && j->seqno > 0 && j->seqno < noutcomes && outcomes[j->seqno].cmd) {
+		outcome_t *o = &outcomes[j->seqno];
+		o->seen = true;
+		o->new_status = job_status(j);
+		o->new_ms = ms;
+	}
+}
+
+static bool add_outcome(int id, int status, long ms, const char *cmd)
+{
+	if(id <= 0)
+		return false;
+	if(id >= noutcomes) {
+		int n = noutcomes ? noutcomes : 64;
+		while(n <= id)
+			n *= 2;
+		outcome_t *grown = (outcome_t *)realloc(outcomes, n * sizeof(outcome_t));
+		if(!grown)
+			return false;
+		memset(grown + noutcomes, 0, (n - noutcomes) * sizeof(outcome_t));
+		outcomes = grown;
+		noutcomes = n;
+	}
+	free(outcomes[id].cmd);
+	outcomes[id].status = status;
+	outcomes[id].ms = ms;
+	outcomes[id].cmd = strdup(cmd);
+	return true;
+}
+
+/* serve events (the reaper, deadlines, ...) for up to sec seconds */
+static void idle(double sec)
+{
+	double until = monotonic_now() + sec, left;
+
+	while((left = until - monotonic_now()) > 0)
+		event_dispatch((int)(left * 1000) + 1);
+}
+
+/* runs one recorded line, here-documents included; false once the
+ * session has ended ("quit") */
+static bool run_line(char *text)
+{
+	job_t *j, *ji, *j_next;
+	FILE *in;
+	int n = 0;
+
+	if(!(in = fmemopen(text, strlen(text), "r")))
+		return true;
+	j = freadcmdline(in, "");
+	fclose(in);
+	if(!j)
+		return true;
+	/* only the jobs of this line, as in run_jobs() */
+	for(ji = j; ji; ji = ji->next)
+		n++;
+	append_jobs(j);
+	for(ji = j; n > 0; n--, ji = j_next) {
+		j_next = ji->next;
+		if(ji->first_process->argc > 0 && !strcmp(ji->first_process->argv[0], "quit")) {
+			for(; n > 0; n--, ji = j_next) { /* leave the jobs still running to the report */
+				j_next = ji->next;
+				stable_delete_job(ji);
+			}
+			return false;
+		}
+		run_job(ji, false);
+	}
+	if(count_jobs() > MAX_HISTORY)
+		delete_completed_job();
+	return true;
+}
+
+static int report(double tolerance)
+{
+	int i, compared = 0, changed = 0, slower = 0, missing = 0;
+
+	fprintf(stdout, "replay:\n");
+	for(i = 1; i < noutcomes; i++) {
+		outcome_t *o = &outcomes[i];
+		if(!o->cmd)
+			continue;
+		if(!o->seen) {
+			fprintf(stdout, "  job %d %s: did not run\n", i, o->cmd);
+			++missing;
+			continue;
+		}
+		++compared;
+		if(o->new_status != o->status) {
+			fprintf(stdout, "  job %d %s: status %d -> %d\n", i, o->cmd, o->status, o->new_status);
+			++changed;
+		}
+		if(o->new_ms - o->ms > SESSION_SLACK_MS && o->new_ms > o->ms * (1 + tolerance / 100)) {
+			fprintf(stdout, "  job %d %s: %ldms -> %ldms (+%.1f%%)\n", i, o->cmd, o->ms, o->new_ms,
+				o->ms ? 100.0 * (o->new_ms - o->ms) / o->ms : 100.0);
+			++slower;
+		}
+	}
+	fprintf(stdout, "replay: %d jobs compared, %d status changed, %d slower, %d did not run\n",
+		compared, changed, slower, missing);
+	return changed || slower || missing ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Replays the recording at path, at the recorded pace unless fast, and
+ * returns 0 if every job behaved as recorded. */
+int run_replay(const char *path, bool fast)
+{
+	FILE *f = fopen(path, "r");
+	char buf[MAX_LEN_CMDLINE + 64];
+	char **lines = NULL;
+	long *gaps = NULL;
+	int nlines = 0, cap = 0, i, id, status, off;
+	long ms;
+	const char *tol = getenv("DSH_REPLAY_TOLERANCE");
+	double prev;
+
+	if(!f) {
+		perror(path);
+		return 127;
+	}
+	while(fgets(buf, sizeof(buf), f)) {
+		strip_newline(buf);
+		if(sscanf(buf, "L %ld %n", &ms, &off) == 1) {
+			if(nlines == cap) {
+				cap = cap ? cap * 2 : 64;
+				char **l = (char **)realloc(lines, cap * sizeof(char *));
+				long *g = (long *)realloc(gaps, cap * sizeof(long));
+				if(l)
+					lines = l;
+				if(g)
+					gaps = g;
+				if(!l || !g) {
+					fprintf(stderr, "%s\n","malloc: no space");
+					return EXIT_FAILURE;
+				}
+			}
+			gaps[nlines] = ms;
+			if(asprintf(&lines[nlines], "%s\n", buf + off) < 0)
+				lines[nlines] = NULL;
+			++nlines;
+		} else if(buf[0] == 'C' && buf[1] == ' ' && nlines && lines[nlines - 1]) {
+			char *joined;
+			if(asprintf(&joined, "%s%s\n", lines[nlines - 1], buf + 2) >= 0) {
+				free(lines[nlines - 1]);
+				lines[nlines - 1] = joined;
+			}
+		} else if(sscanf(buf, "J %d %d %ld %n", &id, &status, &ms, &off) == 3) {
+			add_outcome(id, status, ms, buf + off);
+		}
+	}
+	fclose(f);
+
+	dsh_quiet = true;
+	replaying = true;
+	prev = monotonic_now();
+	for(i = 0; i < nlines; i++) {
+		if(!fast)
+			idle(prev + gaps[i] / 1000.0 - monotonic_now());
+		prev = monotonic_now();
+		if(lines[i] && !run_line(lines[i]))
+			break;
+	}
+	for(i = 0; i < nlines; i++)
+		free(lines[i]);
+	free(lines);
+	free(gaps);
+	while(jobs_running())
+		event_dispatch(-1);
+
+	status = report(tol ? atof(tol) : 20);
+	for(i = 0; i < noutcomes; i++)
+		free(outcomes[i].cmd);
+	free(outcomes);
+	return status;
+}
@@ -0,0 +1,105 @@
+#!/bin/bash
+# Soak test for dsh: feeds one long-lived dsh a mixed workload (pipelines,
+# < and > redirections, here-strings, ";", background jobs, a stopped job
+# resumed with fg and bg) and fails if its resident set size or number of
+# open file descriptors grows between a warm-up checkpoint and the end.
+# Nothing waits for the background jobs, so their completed entries must
+# not pile up either.
+#
+# At the end dsh gets EOF and has to exit with status 0, so a dsh built
+# with ASan/LSan or run under valgrind --error-exitcode fails the soak on
+# any error it reports (make asan, make memcheck).
+#
+#   ./soak.sh [dsh command...]      (default ./dsh; or: make soak)
+#
+# SOAK_ROUNDS (default 1000) sets the length of the run, SOAK_RSS_SLACK_KB
+# (default 256) how much RSS growth is tolerated as allocator noise; "off"
+# skips the RSS check for instrumented allocators.
+
+[ $# -gt 0 ] || set -- ./dsh
+ROUNDS=${SOAK_ROUNDS:-1000}
+WARMUP=$((ROUNDS / 10 + 1))
+SLACK=${SOAK_RSS_SLACK_KB:-256}
+
+dir=$(mktemp -d /tmp/dsh-soak.XXXXXX) || exit 1
+trap 'exec 3>&-; [ -n "$pid" ] && kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+# a job that stops itself, so the round has something to fg and bg
+echo 'kill -STOP $$' > "$dir/stop.sh"
+seq 1 500 > "$dir/in"
+
+mkfifo "$dir/fifo"
+"$@" < "$dir/fifo" > /dev/null 2> "$dir/err" &
+pid=$!
+exec 3> "$dir/fifo"
+
+round() {
+	cat >&3 <<EOF
+ls / | sort | wc -l
+cat $dir/in | grep 7 | wc -l > $dir/out
+sort -r < $dir/in | head -5 > $dir/out ; wc -c < $dir/out
+tr a-z A-Z <<< soak ; true ; false
+echo x > $dir/out > $dir/out2
+sleep 0 &
+cat < $dir/in > /dev/null &
+sh $dir/stop.sh
+fg
+sh $dir/stop.sh
+bg
+jobs
+touch $dir/mark.$1
+EOF
+}
+
+# waits until dsh has run round $1; 30s without progress is a hang
+done_round() {
+	local t=0
+	while [ ! -e "$dir/mark.$1" ]; do
+		if ! kill -0 $pid 2>/dev/null; then
+			echo "soak: dsh exited in round $1" >&2
+			cat "$dir/err" >&2
+			exit 1
+		fi
+		if [ $((t += 1)) -gt 3000 ]; then
+			echo "soak: dsh hangs in round $1" >&2
+			exit 1
+		fi
+		sleep 0.01
+	done
+}
+
+sample() {
+	rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status)
+	fds=$(ls /proc/$pid/fd | wc -l)
+}
+
+for ((i = 1; i <= ROUNDS; i++)); do
+	round $i
+	done_round $i
+	if [ $i -eq $WARMUP ]; then
+		sample
+		rss0=$rss fds0=$fds
+	fi
+done
+sample
+
+echo "soak: $ROUNDS rounds, RSS ${rss0}kB -> ${rss}kB, fds $fds0 -> $fds"
+if [ $fds -gt $fds0 ]; then
+	echo "soak: dsh leaks file descriptors" >&2
+	exit 1
+fi
+if [ "$SLACK" != off ] && [ $rss -gt $((rss0 + SLACK)) ]; then
+	echo "soak: dsh RSS grew by $((rss - rss0))kB" >&2
+	exit 1
+fi
+
+exec 3>&-
+wait $pid
+status=$?
+pid=
+if [ $status -ne 0 ]; then
+	echo "soak: dsh exited with status $status" >&2
+	cat "$dir/err" >&2
+	exit 1
+fi
+exit 0
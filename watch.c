@@ -0,0 +1,449 @@
+#include "dsh.h"
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <libgen.h>
+
+/* Re-running jobs when their inputs change: "watch [-f path]... cmdline"
+ * runs cmdline as a background job, then again whenever one of its <
+ * input files or one of the -f paths changes. Changes are coalesced: a
+ * run starts only after WATCH_SETTLE_MS without further events, so an
+ * editor's save or a copy in many writes causes one run. If the previous
+ * run is still going by then, it gets SIGTERM and the new run starts as
+ * soon as it is gone. Each run starts with an empty > file, so it holds
+ * the output of the latest run only.
+ *
+ * The parent directories are watched rather than the files, so a file
+ * that is replaced by a rename (as most editors save) or does not exist
+ * yet still counts. All entries share one inotify fd, and directories
+ * shared by several entries are watched once. Entries waiting to settle
+ * form a FIFO, since every event pushes its entry's start out by the
+ * same delay, so one timerfd serves them all. "watch" lists the entries
+ * and "watch cancel <id|all>" removes them. */
+
+#define WATCH_BUCKETS 64
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_MAX_PATHS 16
+
+typedef struct subscriber {
+	struct subscriber *next;
+	char *name;             /* file name within the directory */
+	watch_t *w;
+} subscriber_t;
+
+typedef struct watch_dir {
+	struct watch_dir *next;
+	int wd;
+	char *path;
+	subscriber_t *subscribers;
+} watch_dir_t;
+
+struct watch {
+	struct watch *next, *prev;      /* list of all entries */
+	struct watch *settle_next, *settle_prev; /* FIFO of entries waiting to settle */
+	bool settling;
+	int id;
+	job_t *template;        /* as parsed; every run is a clone_job() of it */
+	char *paths[WATCH_MAX_PATHS];
+	int npaths;
+	double due;             /* when the run for the last change may start */
+	bool cancelled;
+	bool restart;           /* start a run once the current one is gone */
+	job_t *run;             /* the latest run */
+	int refs;               /* jobs on the job list that point here */
+	unsigned long runs, events, terminated;
+};
+
+static watch_dir_t *dirs[WATCH_BUCKETS];
+static watch_t *watches = NULL;
+static watch_t *settle_head = NULL, *settle_tail = NULL;
+static int inotify_fd = -1, timer_fd = -1;
+static int next_id = 1;
+
+static watch_dir_t *dir_lookup(int wd)
+{
+	watch_dir_t *d;
+	for(d = dirs[wd % WATCH_BUCKETS]; d; d = d->next)
+		if(d->wd == wd)
+			return d;
+	return NULL;
+}
+
+static void arm()
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if(settle_head) {
+		double due = settle_head->due > 1e-9 ? settle_head->due : 1e-9;
+		its.it_value.tv_sec = (time_t)due;
+		its.it_value.tv_nsec = (long)((due - (time_t)due) * 1e9);
+	}
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void settle_remove(watch_t *w)
+{
+	if(!w->settling)
+		return;
+	if(w->settle_prev)
+		w->settle_prev->settle_next = w->settle_next;
+	else
+		settle_head = w->settle_next;
+	if(w->settle_next)
+		w->settle_next->settle_prev = w->settle_prev;
+	else
+		settle_tail = w->settle_prev;
+	w->settle_next = w->settle_prev = NULL;
+	w->settling = false;
+}
+
+/* a change for w: (re)start its settle delay at the end of the FIFO */
+static void changed(watch_t *w)
+{
+	if(w->cancelled)
+		return;
+	++w->events;
+	settle_remove(w);
+	w->due = monotonic_now() + WATCH_SETTLE_MS / 1000.0;
+	w->settling = true;
+	w->settle_prev = settle_tail;
+	if(settle_tail)
+		settle_tail->settle_next = w;
+	else
+		settle_head = w;
+	settle_tail = w;
+	if(settle_head == w)
+		arm();
+}
+
+static void launch(watch_t *w)
+{
+	bool quiet = dsh_quiet;
+	process_t *p;
+	job_t *j;
+
+	w->restart = false;
+	if(!(j = clone_job(w->template)))
+		return;
+	/* > appends; a rerun replaces the output of the last run instead */
+	for(p = j->first_process; p->next; p = p->next);
+	if(j->mystdout == OUTPUT_FD && p->ofile && truncate(p->ofile, 0) < 0 && errno != ENOENT)
+		perror(p->ofile);
+	j->bg = true;
+	j->watch = w;
+	w->run = j;
+	++w->refs;
+	++w->runs;
+	optimize_job(j);
+	zstream_job(j);
+	append_jobs(j); /* spawned here only, as for every (schedule.c) */
+	dsh_quiet = true;
+	spawn_job(j, false);
+	dsh_quiet = quiet;
+}
+
+/* the entry settled: start a run, or stop the one still going first */
+static void start(watch_t *w)
+{
+	if(w->run && w->run->pgid > 0 && !job_is_completed(w->run)) {
+		if(!w->restart) {
+			kill(-w->run->pgid, SIGTERM);
+			kill(-w->run->pgid, SIGCONT);
+			++w->terminated;
+		}
+		w->restart = true; /* watch_done() starts the new run */
+		return;
+	}
+	launch(w);
+}
+
+static void watch_settled(int fd, void *arg)
+{
+	uint64_t expirations;
+	double now = monotonic_now();
+	watch_t *w;
+
+	if(read(fd, &expirations, sizeof(expirations)) < 0) { /* spurious wakeup */ }
+	while((w = settle_head) && w->due <= now) {
+		settle_remove(w);
+		start(w);
+	}
+	arm();
+}
+
+static void watch_events(int fd, void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	watch_dir_t *d;
+	subscriber_t *s;
+	watch_t *w;
+	ssize_t n;
+	char *p;
+
+	while((n = read(fd, buf, sizeof(buf))) > 0) {
+		for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if(ev->mask & IN_Q_OVERFLOW) {
+				/* events were lost; any entry may have changed */
+				for(w = watches; w; w = w->next)
+					changed(w);
+				continue;
+			}
+			if(!(d = dir_lookup(ev->wd)))
+				continue;
+			if(ev->mask & IN_IGNORED) {
+				fprintf(stderr, "watch: %s is gone\n", d->path);
+				continue;
+			}
+			for(s = d->subscribers; s; s = s->next)
+				if(ev->len && !strcmp(s->name, ev->name))
+					changed(s->w);
+		}
+	}
+}
+
+static bool init()
+{
+	if(inotify_fd >= 0)
+		return true;
+	if((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		perror("inotify_init1");
+		return false;
+	}
+	if((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		perror("timerfd_create");
+		close(inotify_fd);
+		inotify_fd = -1;
+		return false;
+	}
+	if(!event_add(inotify_fd, watch_events, NULL) || !event_add(timer_fd, watch_settled, NULL)) {
+		event_del(inotify_fd);
+		close(inotify_fd);
+		close(timer_fd);
+		inotify_fd = timer_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+/* subscribe w to changes of path */
+static bool subscribe(watch_t *w, const char *path)
+{
+	char *copy1 = strdup(path), *copy2 = strdup(path);
+	char dir[PATH_MAX];
+	watch_dir_t *d;
+	subscriber_t *s;
+	bool ok = false;
+	int wd;
+
+	if(!copy1 || !copy2 || !realpath(dirname(copy1), dir)) {
+		perror(path);
+		goto out;
+	}
+	if((wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK)) < 0) {
+		perror(dir);
+		goto out;
+	}
+	if(!(d = dir_lookup(wd))) {
+		if(!(d = (watch_dir_t *)calloc(1, sizeof(watch_dir_t))))
+			goto out;
+		d->wd = wd;
+		d->path = strdup(dir);
+		d->next = dirs[wd % WATCH_BUCKETS];
+		dirs[wd % WATCH_BUCKETS] = d;
+	}
+	if(!(s = (subscriber_t *)calloc(1, sizeof(subscriber_t))))
+		goto out;
+	s->name = strdup(basename(copy2));
+	s->w = w;
+	s->next = d->subscribers;
+	d->subscribers = s;
+	ok = true;
+out:
+	free(copy1);
+	free(copy2);
+	return ok;
+}
+
+/* drop every subscription of w, and the directories nobody watches now */
+static void unsubscribe(watch_t *w)
+{
+	watch_dir_t **dl, *d;
+	subscriber_t **sl, *s;
+	int i;
+
+	for(i = 0; i < WATCH_BUCKETS; i++) {
+		for(dl = &dirs[i]; (d = *dl);) {
+			for(sl = &d->subscribers; (s = *sl);) {
+				if(s->w == w) {
+					*sl = s->next;
+					free(s->name);
+					free(s);
+				} else {
+					sl = &s->next;
+				}
+			}
+			if(d->subscribers) {
+				dl = &d->next;
+				continue;
+			}
+			inotify_rm_watch(inotify_fd, d->wd);
+			*dl = d->next;
+			free(d->path);
+			free(d);
+		}
+	}
+}
+
+static void release(watch_t *w)
+{
+	int i;
+
+	if(!w->cancelled || w->refs > 0)
+		return;
+	for(i = 0; i < w->npaths; i++)
+		free(w->paths[i]);
+	free_job(w->template);
+	free(w);
+}
+
+static void cancel(watch_t *w)
+{
+	w->cancelled = true;
+	w->restart = false;
+	settle_remove(w);
+	unsubscribe(w);
+	if(w->prev)
+		w->prev->next = w->next;
+	else
+		watches = w->next;
+	if(w->next)
+		w->next->prev = w->prev;
+	release(w);
+}
+
+/* A run of w completed (called from the reaper) */
+void watch_done(job_t *j)
+{
+	watch_t *w = j->watch;
+
+	if(w->restart && w->run == j)
+		launch(w);
+}
+
+/* j is being freed */
+void watch_free(job_t *j)
+{
+	watch_t *w = j->watch;
+
+	if(!w)
+		return;
+	j->watch = NULL;
+	if(w->run == j)
+		w->run = NULL;
+	--w->refs;
+	release(w);
+}
+
+/* true while any entry is watching */
+bool watch_pending()
+{
+	return watches != NULL;
+}
+
+static void list()
+{
+	watch_t *w, *last;
+	int i;
+
+	for(last = watches; last && last->next; last = last->next);
+	for(w = last; w; w = w->prev) { /* oldest first */
+		fprintf(stdout, "#%d %s\n  watching", w->id, w->template->commandinfo);
+		for(i = 0; i < w->npaths; i++)
+			fprintf(stdout, "%s %s", i ? "," : "", w->paths[i]);
+		fprintf(stdout, "; %lu runs for %lu file events, %lu runs stopped early, %s\n",
+			w->runs, w->events, w->terminated,
+			w->run && !job_is_completed(w->run) ? "running" : "idle");
+	}
+}
+
+/* "watch [-f path]... cmdline", "watch" to list and
+ * "watch cancel <id|all>" */
+void watch_cmd(job_t *j, int argc, char **argv)
+{
+	process_t *p;
+	watch_t *w, *w_next;
+	job_t *t;
+	int i, skip = 1;
+
+	if(argc == 1) {
+		list();
+		return;
+	}
+	if(argc == 3 && !strcmp(argv[1], "cancel")) {
+		bool all = !strcmp(argv[2], "all"), found = false;
+		for(w = watches; w; w = w_next) {
+			w_next = w->next;
+			if(all || w->id == atoi(argv[2])) {
+				cancel(w);
+				found = true;
+			}
+		}
+		if(!found && !all)
+			fprintf(stderr, "watch: no entry %s\n", argv[2]);
+		return;
+	}
+	if(!init())
+		return;
+	if(!(w = (watch_t *)calloc(1, sizeof(watch_t)))) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		return;
+	}
+	w->id = next_id++;
+	while(skip + 1 < argc && !strcmp(argv[skip], "-f")) {
+		if(w->npaths == WATCH_MAX_PATHS) {
+			fprintf(stderr, "watch: more than %d paths\n", WATCH_MAX_PATHS);
+			goto fail;
+		}
+		w->paths[w->npaths++] = strdup(argv[skip + 1]);
+		skip += 2;
+	}
+	if(skip == argc) {
+		fprintf(stderr, "usage: watch [-f path]... cmdline\n");
+		goto fail;
+	}
+	shift_argv(j->first_process, skip);
+	drop_words(j->commandinfo, skip);
+	if(!(t = clone_job(j)))
+		goto fail;
+	w->template = t;
+	if(!alias_expand(t) || deadline_prefix(t))
+		goto fail;
+	if(is_builtin(t->first_process->argv[0]) || !strcmp(t->first_process->argv[0], "cache")) {
+		fprintf(stderr, "watch: %s: only external commands can be watched\n", t->first_process->argv[0]);
+		goto fail;
+	}
+	for(p = t->first_process; p; p = p->next)
+		if(p->ifile && w->npaths < WATCH_MAX_PATHS)
+			w->paths[w->npaths++] = strdup(p->ifile);
+	if(!w->npaths) {
+		fprintf(stderr, "watch: no < input or -f path to watch\n");
+		goto fail;
+	}
+	for(i = 0; i < w->npaths; i++)
+		if(!subscribe(w, w->paths[i]))
+			goto fail;
+
+	w->next = watches;
+	if(watches)
+		watches->prev = w;
+	watches = w;
+	if(!dsh_quiet)
+		fprintf(stdout, "#%d watching: %s\n", w->id, t->commandinfo);
+	launch(w);
+	return;
+fail:
+	w->cancelled = true;
+	unsubscribe(w);
+	release(w);
+}
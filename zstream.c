@@ -0,0 +1,266 @@
+#include "dsh.h"
+#include <zlib.h>
+#include <pthread.h>
+
+/* Compressed redirections. "cmd > out.gz" and "cmd < in.gz" (likewise
+ * .zst) get an extra pipeline stage between the command and the file, so
+ * the data reaches the disk compressed and is never written twice:
+ *   - .gz is handled by dsh itself: the stage is a forked dsh that runs
+ *     zstream_main() instead of an exec. Output is cut into blocks that
+ *     are deflated in parallel, each as a gzip member of its own; a
+ *     concatenation of members is a valid .gz file, which also keeps >
+ *     appending as it does for plain files.
+ *   - .zst runs the zstd program, which has its own worker threads.
+ * The extra stage belongs to the job, so the job only completes once the
+ * file is complete. "compress" sets the level and the number of threads;
+ * "compress verbose on" makes each stage report the I/O it saved. */
+
+int dsh_zlevel = 6;            /* 1 (fast) .. 9 (small); zstd takes up to 19 */
+int dsh_zthreads = 0;          /* compressor threads; 0 for one per CPU */
+bool dsh_zverbose = false;
+
+enum { Z_NONE, Z_GZIP, Z_ZSTD };
+
+static int zkind(const char *file)
+{
+	if(endswith(file, ".gz"))
+		return Z_GZIP;
+	if(endswith(file, ".zst"))
+		return Z_ZSTD;
+	return Z_NONE;
+}
+
+/* a new stage running the given argv (NULL terminated) */
+static process_t *new_stage(const char **argv)
+{
+	process_t *p = (process_t *)malloc(sizeof(process_t));
+
+	if(!p || !init_process(p)) {
+		free(p);
+		fprintf(stderr, "%s\n","malloc: no space");
+		return NULL;
+	}
+	for(; *argv && p->argc < MAX_ARGS - 1; argv++)
+		p->argv[p->argc++] = strdup(*argv);
+	p->added = true;
+	return p;
+}
+
+static process_t *compress_stage(int kind)
+{
+	char level[24], threads[24];
+	long n = dsh_zthreads;
+
+	if(n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+	snprintf(level, sizeof(level), "-%d", dsh_zlevel);
+	if(kind == Z_GZIP) {
+		const char *argv[] = { ZSTREAM_CMD, level, threads, dsh_zverbose ? "-v" : NULL, NULL };
+		snprintf(threads, sizeof(threads), "-p%ld", n);
+		return new_stage(argv);
+	} else {
+		const char *argv[] = { "zstd", "-c", level, threads, dsh_zverbose ? "-v" : "-q", NULL };
+		snprintf(threads, sizeof(threads), "-T%ld", n);
+		return new_stage(argv);
+	}
+}
+
+static process_t *decompress_stage(int kind)
+{
+	const char *gz[] = { ZSTREAM_CMD, "-d", NULL };
+	const char *zst[] = { "zstd", "-d", "-c", "-q", NULL };
+
+	return new_stage(kind == Z_GZIP ? gz : zst);
+}
+
+/* Give every compressed < and > redirection of j its own stage. The
+ * redirection moves to the new stage, so redirect_io() needs no change. */
+void zstream_job(job_t *j)
+{
+	process_t *p, *stage, **link;
+	int kind;
+
+	for(link = &j->first_process; (p = *link); link = &p->next) {
+		if(j->mystdin == INPUT_FD && p->ifile && (kind = zkind(p->ifile))
+			&& (stage = decompress_stage(kind))) {
+			stage->ifile = p->ifile;
+			p->ifile = NULL;
+			stage->next = p;
+			*link = stage;
+		}
+		if(j->mystdout == OUTPUT_FD && !p->next && p->ofile && (kind = zkind(p->ofile))
+			&& (stage = compress_stage(kind))) {
+			stage->ofile = p->ofile;
+			p->ofile = NULL;
+			p->next = stage;
+			break;
+		}
+	}
+}
+
+/* fill buf from fd; returns the byte count, short only at EOF */
+static ssize_t read_full(int fd, unsigned char *buf, size_t n)
+{
+	size_t got = 0;
+	ssize_t r;
+	while(got < n) {
+		if((r = read(fd, buf + got, n - got)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(r == 0)
+			break;
+		got += r;
+	}
+	return got;
+}
+
+typedef struct zblock {
+	unsigned char *in, *out;
+	size_t nin, nout, cap;
+	int level;
+	bool ok;
+} zblock_t;
+
+/* deflate one block into a complete gzip member */
+static void *deflate_block(void *arg)
+{
+	zblock_t *b = (zblock_t *)arg;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	b->ok = false;
+	if(deflateInit2(&zs, b->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+	zs.next_in = b->in;
+	zs.avail_in = b->nin;
+	zs.next_out = b->out;
+	zs.avail_out = b->cap;
+	b->ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+	b->nout = b->cap - zs.avail_out;
+	deflateEnd(&zs);
+	return NULL;
+}
+
+static int gzip_compress(int level, int nthreads, bool verbose)
+{
+	zblock_t *blocks = (zblock_t *)calloc(nthreads, sizeof(zblock_t));
+	pthread_t *tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	unsigned long long in = 0, out = 0;
+	bool eof = false;
+	int i, n;
+
+	if(!blocks || !tids)
+		return EXIT_FAILURE;
+	for(i = 0; i < nthreads; i++) {
+		blocks[i].level = level;
+		blocks[i].cap = compressBound(ZSTREAM_BLOCK) + 64; /* + gzip header and trailer */
+		blocks[i].in = (unsigned char *)malloc(ZSTREAM_BLOCK);
+		blocks[i].out = (unsigned char *)malloc(blocks[i].cap);
+		if(!blocks[i].in || !blocks[i].out)
+			return EXIT_FAILURE;
+	}
+	while(!eof) {
+		/* read up to one block per thread, deflate them together */
+		for(n = 0; n < nthreads && !eof; n++) {
+			ssize_t r = read_full(STDIN_FILENO, blocks[n].in, ZSTREAM_BLOCK);
+			if(r < 0) {
+				perror("read");
+				return EXIT_FAILURE;
+			}
+			blocks[n].nin = r;
+			eof = r < ZSTREAM_BLOCK;
+			if(r == 0 && (n > 0 || in > 0))
+				break; /* no empty trailing member */
+		}
+		for(i = 1; i < n; i++)
+			if(pthread_create(&tids[i], NULL, deflate_block, &blocks[i]) != 0) {
+				tids[i] = 0;
+				deflate_block(&blocks[i]);
+			}
+		deflate_block(&blocks[0]);
+		for(i = 1; i < n; i++)
+			if(tids[i])
+				pthread_join(tids[i], NULL);
+		for(i = 0; i < n; i++) {
+			if(!blocks[i].ok) {
+				fprintf(stderr, "%s: deflate failed\n", ZSTREAM_CMD);
+				return EXIT_FAILURE;
+			}
+			if(!write_all(STDOUT_FILENO, blocks[i].out, blocks[i].nout)) {
+				perror("write");
+				return EXIT_FAILURE;
+			}
+			in += blocks[i].nin;
+			out += blocks[i].nout;
+		}
+	}
+	if(verbose)
+		fprintf(stderr, "%s: %llu bytes in, %llu bytes written (%.1f%% of the input)\n",
+			ZSTREAM_CMD, in, out, in ? 100.0 * out / in : 0.0);
+	return EXIT_SUCCESS;
+}
+
+static int gzip_decompress()
+{
+	gzFile gz = gzdopen(STDIN_FILENO, "rb");
+	unsigned char buf[1 << 16];
+	int n, err;
+
+	if(!gz)
+		return EXIT_FAILURE;
+	/* gzread() continues across concatenated members */
+	while((n = gzread(gz, buf, sizeof(buf))) > 0)
+		if(!write_all(STDOUT_FILENO, buf, n))
+			return EXIT_FAILURE;
+	if(n < 0) {
+		fprintf(stderr, "%s: %s\n", ZSTREAM_CMD, gzerror(gz, &err));
+		return EXIT_FAILURE;
+	}
+	gzclose(gz);
+	return EXIT_SUCCESS;
+}
+
+/* Body of a ZSTREAM_CMD stage, run in the forked child instead of an
+ * exec: "-d" decompresses stdin to stdout, otherwise "-<level>",
+ * "-p<threads>" and "-v" (report) compress it. Returns the exit status. */
+int zstream_main(int argc, char **argv)
+{
+	int i, level = Z_DEFAULT_COMPRESSION, threads = 1;
+	bool verbose = false;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-d"))
+			return gzip_decompress();
+		else if(!strcmp(argv[i], "-v"))
+			verbose = true;
+		else if(!strncmp(argv[i], "-p", 2))
+			threads = atoi(argv[i] + 2);
+		else if(argv[i][0] == '-')
+			level = atoi(argv[i] + 1);
+	}
+	if(level > 9)
+		level = 9; /* the shared level may be meant for zstd */
+	if(level < 1)
+		level = Z_DEFAULT_COMPRESSION;
+	if(threads < 1)
+		threads = 1;
+	return gzip_compress(level, threads, verbose);
+}
+
+/* "compress [level <n>|threads <n>|verbose on|off]" */
+void compress_cmd(int argc, char **argv)
+{
+	if(argc == 3 && !strcmp(argv[1], "level") && atoi(argv[2]) > 0)
+		dsh_zlevel = atoi(argv[2]);
+	else if(argc == 3 && !strcmp(argv[1], "threads") && atoi(argv[2]) >= 0)
+		dsh_zthreads = atoi(argv[2]);
+	else if(argc == 3 && !strcmp(argv[1], "verbose"))
+		dsh_zverbose = !strcmp(argv[2], "on");
+	else if(argc == 1)
+		fprintf(stdout, "compress: level %d, %d thread(s)%s, verbose %s\n", dsh_zlevel,
+			dsh_zthreads, dsh_zthreads ? "" : " (one per CPU)", dsh_zverbose ? "on" : "off");
+	else
+		fprintf(stderr, "usage: compress [level <n>|threads <n>|verbose on|off]\n");
+}